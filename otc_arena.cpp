@@ -0,0 +1,64 @@
+/**
+  \author Matthew Strait
+  \brief Bump allocator for per-event storage.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "otc_arena.h"
+
+// Smallest chunk to bother with. Enough for a good number of typical
+// events.
+static const size_t MINCHUNK = 1 << 16;
+
+otc_arena::~otc_arena()
+{
+  for(unsigned int i = 0; i < chunks.size(); i++) free(chunks[i]);
+}
+
+/* Slow path of otc_arena_alloc(): add a chunk that can hold at least
+'bytes' bytes and hand them out from it. */
+void * otc_arena_grow(otc_arena & a, const size_t bytes)
+{
+  size_t size = a.sizes.empty()? MINCHUNK: 2*a.sizes.back();
+  while(size < bytes) size *= 2;
+
+  void * chunk;
+  if(posix_memalign(&chunk, OTC_ARENA_ALIGN, size)){
+    fprintf(stderr, "Could not allocate %lu bytes for events\n",
+            (unsigned long)size);
+    exit(1);
+  }
+
+  a.chunks.push_back(static_cast<char *>(chunk));
+  a.sizes.push_back(size);
+  a.used = bytes;
+  return chunk;
+}
+
+void otc_arena_reset(otc_arena & a)
+{
+  // If the last fill needed more than one chunk, replace them all with
+  // one chunk as big as all of them together, so that next time it will
+  // all fit in one.
+  if(a.chunks.size() > 1){
+    size_t total = 0;
+    for(unsigned int i = 0; i < a.chunks.size(); i++){
+      total += a.sizes[i];
+      free(a.chunks[i]);
+    }
+    a.chunks.clear();
+    a.sizes.clear();
+
+    void * chunk;
+    if(posix_memalign(&chunk, OTC_ARENA_ALIGN, total)){
+      fprintf(stderr, "Could not allocate %lu bytes for events\n",
+              (unsigned long)total);
+      exit(1);
+    }
+    a.chunks.push_back(static_cast<char *>(chunk));
+    a.sizes.push_back(total);
+  }
+
+  a.used = 0;
+}
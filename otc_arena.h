@@ -0,0 +1,59 @@
+/**
+  \author Matthew Strait
+  \brief Bump allocator for per-event storage.
+
+  Events are read into memory taken from an arena, which is reset all
+  at once when everyone is done with the events in it. Small events
+  take a small amount of space right next to each other, and big ones
+  make the arena grow instead of running off the end of anything.
+*/
+
+#ifndef OTC_ARENA_H
+#define OTC_ARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+struct otc_arena {
+  // Memory is handed out from the end of the last chunk. When that runs
+  // out, a new bigger chunk is added. Chunks never move, so everything
+  // handed out stays good until the next reset.
+  std::vector<char *> chunks;
+  std::vector<size_t> sizes;
+
+  // Bytes handed out from the last chunk
+  size_t used;
+
+  otc_arena(): used(0) {}
+  ~otc_arena();
+};
+
+// Everything is aligned to this, which is enough for any vector load.
+const size_t OTC_ARENA_ALIGN = 32;
+
+void * otc_arena_grow(otc_arena & a, const size_t bytes);
+
+/// Return 'bytes' bytes of uninitialized memory from the arena.
+static inline void * otc_arena_alloc(otc_arena & a, const size_t bytes)
+{
+  const size_t want = (bytes + OTC_ARENA_ALIGN - 1) & ~(OTC_ARENA_ALIGN - 1);
+  if(a.chunks.empty() || a.used + want > a.sizes.back())
+    return otc_arena_grow(a, want);
+
+  void * const p = a.chunks.back() + a.used;
+  a.used += want;
+  return p;
+}
+
+/// Allocate n objects of type T
+template<class T> static inline T * otc_arena_alloc(otc_arena & a,
+                                                    const size_t n)
+{
+  return static_cast<T *>(otc_arena_alloc(a, n*sizeof(T)));
+}
+
+/// Make all the arena's memory available again. Anything handed out
+/// before is no longer good.
+void otc_arena_reset(otc_arena & a);
+
+#endif
@@ -0,0 +1,308 @@
+/**
+  \author Matthew Strait
+  \brief Microbenchmarks of otc's per-event work on synthetic events.
+
+  Runs each of the things otc does per event over the same set of
+  synthetic events, enough times to get a steady timing, and reports
+  events per second and nanoseconds per hit, with and without vector
+  instructions. Needs neither ROOT nor ZOE, so it can be run anywhere
+  to look for slowdowns.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <vector>
+#include "otc_cont.h"
+#include "otc_arena.h"
+#include "otc_geom.h"
+#include "otc_kernels.h"
+#include "otc_reco.h"
+#include "otc_colfile.h"
+#include "otc_synth.h"
+
+using namespace std;
+
+// The events that every benchmark runs over, and some things about
+// them worked out ahead of time
+struct benchdata {
+  vector<otc_event_view> ev;
+
+  // Indices of the events that lastpos() is called for: muons with XY
+  // overlaps
+  vector<unsigned int> lastposev;
+
+  // The Q column as the doubles it is stored as in muon.root files
+  vector<double> qdouble;
+  vector<int> qint;
+
+  // Results of doit() for each event, to be written out
+  vector<otc_output_event> out;
+
+  // Where they are written. It is made once, so that only filling it
+  // is timed and not making and finishing the file.
+  otc_colfile fill;
+};
+
+// One benchmark: a pass over all the events it is interested in, which
+// returns a digest of its results, so that none of the work can be
+// optimized away and so that plain and vector kernels can be checked
+// against each other, and the number of hits that a pass looks at. For
+// those whose time doesn't go as the number of hits, that is null, and
+// they are timed per event.
+struct benchmark {
+  const char * name;
+  uint64_t (* pass)(benchdata & d);
+  uint64_t (* nhit)(const benchdata & d);
+  uint64_t (* nevent)(const benchdata & d);
+};
+
+static uint64_t all_hits(const benchdata & d)
+{
+  uint64_t n = 0;
+  for(unsigned int i = 0; i < d.ev.size(); i++) n += d.ev[i].nhit;
+  return n;
+}
+
+static uint64_t all_events(const benchdata & d)
+{
+  return d.ev.size();
+}
+
+static uint64_t lastpos_events(const benchdata & d)
+{
+  return d.lastposev.size();
+}
+
+/* Add x to digest h */
+static uint64_t mix(const uint64_t h, const uint64_t x)
+{
+  return (h ^ x)*1099511628211ULL;
+}
+
+/* Add everything in out but the event number, which the kernels don't
+set, to digest h. Coordinates are added exactly, since they are looked
+up rather than worked out. */
+static uint64_t mix_event(uint64_t h, const otc_output_event & out)
+{
+  uint32_t x, y, z;
+  memcpy(&x, &out.lastx, sizeof x);
+  memcpy(&y, &out.lasty, sizeof y);
+  memcpy(&z, &out.lastz, sizeof z);
+  h = mix(h, x);
+  h = mix(h, y);
+  h = mix(h, z);
+  h = mix(h, out.length);
+  h = mix(h, out.nhitup);
+  h = mix(h, out.nhitlo);
+  return mix(h, out.error);
+}
+
+static uint64_t bench_sync(benchdata & d)
+{
+  uint64_t n = 0;
+  for(unsigned int i = 0; i < d.ev.size(); i++)
+    n = mix(n, is_sync_pulse(d.ev[i]));
+  return n;
+}
+
+static uint64_t bench_hits(benchdata & d)
+{
+  uint64_t n = 0;
+  for(unsigned int i = 0; i < d.ev.size(); i++){
+    otc_output_event out;
+    memset(&out, 0, sizeof out);
+    do_hits_stuff(out, d.ev[i], !!d.ev[i].nxy);
+    n = mix_event(n, out);
+  }
+  return n;
+}
+
+static uint64_t bench_lastpos(benchdata & d)
+{
+  uint64_t n = 0;
+  for(unsigned int i = 0; i < d.lastposev.size(); i++){
+    otc_output_event out;
+    memset(&out, 0, sizeof out);
+    lastpos(out, d.ev[d.lastposev[i]]);
+    n = mix_event(n, out);
+  }
+  return n;
+}
+
+static uint64_t bench_doit(benchdata & d)
+{
+  uint64_t n = 0;
+  for(unsigned int i = 0; i < d.ev.size(); i++){
+    bool badhits;
+    n = mix_event(n, doit(d.ev[i], true, badhits));
+  }
+  return n;
+}
+
+static uint64_t bench_convert(benchdata & d)
+{
+  uint64_t n =
+    otc_doubles_to_ints(&d.qint[0], &d.qdouble[0], d.qdouble.size());
+  for(unsigned int i = 0; i < d.qint.size(); i++) n = mix(n, d.qint[i]);
+  return n;
+}
+
+static uint64_t bench_fill(benchdata & d)
+{
+  d.fill.header->nevent = 0;
+  for(unsigned int i = 0; i < d.out.size(); i++)
+    otc_colfile_write(d.fill, d.out[i]);
+  return d.fill.header->nevent;
+}
+
+static const benchmark benchmarks[] = {
+  { "is_sync_pulse", bench_sync,    all_hits,     all_events     },
+  { "do_hits_stuff", bench_hits,    all_hits,     all_events     },
+  { "lastpos",       bench_lastpos, NULL,         lastpos_events },
+  { "doit",          bench_doit,    all_hits,     all_events     },
+  { "fQ to int",     bench_convert, all_hits,     all_events     },
+  { "colfile fill",  bench_fill,    NULL,         all_events     },
+};
+
+static double now()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Run b once, which also warms up, and then over and over for at least
+mintime seconds, and print how fast it was. Returns what one pass
+gives, or exits if the passes don't all give the same. */
+static uint64_t run(const benchmark & b, benchdata & d, const double mintime,
+                    const char * const kind)
+{
+  const uint64_t result = b.pass(d);
+  uint64_t sink = 0;
+  unsigned int passes = 0;
+  const double start = now();
+  double elapsed;
+  do{
+    sink += b.pass(d);
+    passes++;
+  }while((elapsed = now() - start) < mintime);
+
+  const double nevent = double(b.nevent(d))*passes;
+  const double nper = b.nhit? double(b.nhit(d))*passes: nevent;
+  printf("%-14s %-6s %12.4g events/s %9.3f ns/%-5s  (%016lx)\n", b.name,
+         kind, nevent/elapsed, nper? elapsed/nper*1e9: 0.0,
+         b.nhit? "hit": "event", (unsigned long)result);
+
+  if(sink != result*passes){
+    fprintf(stderr, "%s %s doesn't give the same result every time\n",
+            b.name, kind);
+    exit(1);
+  }
+  return result;
+}
+
+static void printhelp()
+{
+  printf(
+  "otc_bench: time otc's per-event work on synthetic events\n"
+  "\n"
+  "-n [number] Number of events to make. Default 100000\n"
+  "-s [number] Random seed. Default 1\n"
+  "-t [seconds] Time to spend on each benchmark. Default 0.5\n"
+  "-h: This help text\n");
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned int nevent = 100000;
+  uint64_t seed = 1;
+  double mintime = 0.5;
+
+  int opt;
+  while((opt = getopt(argc, argv, "n:s:t:h")) != -1){
+    char * endptr;
+    errno = 0;
+    switch(opt){
+      case 'n': nevent = strtoul(optarg, &endptr, 10); break;
+      case 's': seed = strtoull(optarg, &endptr, 10); break;
+      case 't': mintime = strtod(optarg, &endptr); break;
+      case 'h': printhelp(); return 0;
+      default: printhelp(); return 1;
+    }
+    if(errno || endptr == optarg || *endptr != '\0' || nevent == 0){
+      fprintf(stderr, "%s (given with -%c) isn't a number I can handle\n",
+              optarg, opt);
+      return 1;
+    }
+  }
+
+  otc_synth_geometry();
+
+  otc_synth g;
+  otc_synth_seed(g, seed);
+  otc_arena arena;
+  otc_event_batch batch;
+  otc_synth_batch(g, batch, 0, nevent, arena);
+
+  benchdata d;
+  d.ev.resize(nevent);
+  for(unsigned int i = 0; i < nevent; i++){
+    otc_batch_event(d.ev[i], batch, i);
+    if(d.ev[i].nxy && d.ev[i].nhit && !is_sync_pulse(d.ev[i]))
+      d.lastposev.push_back(i);
+  }
+
+  const unsigned int nhit = batch.hitoffset[nevent];
+  d.qdouble.assign(batch.Q, batch.Q + nhit);
+  d.qint.resize(nhit);
+
+  otc_kernels_init(false);
+  d.out.resize(nevent);
+  for(unsigned int i = 0; i < nevent; i++){
+    bool badhits;
+    d.out[i] = doit(d.ev[i], true, badhits);
+  }
+
+  char outfile[] = "/tmp/otc_bench_XXXXXX";
+  const int fd = mkstemp(outfile);
+  if(fd < 0){
+    fprintf(stderr, "Could not make a temporary file: %s\n", strerror(errno));
+    return 1;
+  }
+  close(fd);
+  otc_colfile_create(d.fill, outfile, true, 0, nevent, 0);
+
+  printf("%u synthetic events, %u hits, %.1f hits/event\n", nevent, nhit,
+         double(nhit)/nevent);
+
+  // The vector kernels have to give exactly what the plain ones do
+  const unsigned int nbench = sizeof benchmarks/sizeof *benchmarks;
+  uint64_t plain[nbench];
+  int status = 0;
+  for(int simd = 0; simd < 2; simd++){
+    otc_kernels_init(simd);
+    if(simd && !otc_kernels_simd()){
+      printf("No vector instructions on this CPU\n");
+      break;
+    }
+    for(unsigned int i = 0; i < nbench; i++){
+      const uint64_t result =
+        run(benchmarks[i], d, mintime, simd? "simd": "plain");
+      if(!simd) plain[i] = result;
+      else if(result != plain[i]){
+        fprintf(stderr, "%s gives different results with and without "
+                "vector instructions\n", benchmarks[i].name);
+        status = 1;
+      }
+    }
+  }
+
+  otc_colfile_finish(d.fill);
+  unlink(outfile);
+  return status;
+}
@@ -0,0 +1,308 @@
+/**
+  \author Matthew Strait
+  \brief Binary cache of the input hit and XY overlap columns.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otc_cache.h"
+
+static const char CACHEMAGIC[8] = { 'O', 'T', 'C', 'H', 'I', 'T', 'C', '2' };
+
+// The columns of a block, in the order they are stored
+enum { HITOFFSET, CHNUM, STATUS, Q, TIME, XYOFFSET, XYNHIT, XYHITS, READOK,
+       NARRAY };
+
+static uint64_t align(const uint64_t n)
+{
+  return (n + OTC_CACHE_ALIGN - 1) & ~(OTC_CACHE_ALIGN - 1);
+}
+
+/* Find where each column of a block with header h starts, counting from
+the start of the block, and return the size of the whole block. */
+static uint64_t block_layout(const otc_cache_block & h, uint64_t off[NARRAY])
+{
+  const uint64_t n = h.n, nhit = h.nhit, nxy = h.nxy;
+  const uint64_t size[NARRAY] = {
+    (n+1)*sizeof(unsigned int),
+    nhit*sizeof(unsigned int),
+    nhit*sizeof(unsigned short),
+    nhit*sizeof(int),
+    nhit*sizeof(int),
+    (n+1)*sizeof(unsigned int),
+    nxy*sizeof(int),
+    nxy*OTC_MAXXYHIT*sizeof(int),
+    n*sizeof(bool),
+  };
+
+  uint64_t pos = align(sizeof h);
+  for(int i = 0; i < NARRAY; i++){
+    off[i] = pos;
+    pos = align(pos + size[i]);
+  }
+  return pos;
+}
+
+/* Write 'bytes' bytes of data and then pad to the alignment */
+static void put(otc_cache_writer & w, const void * const data,
+                const uint64_t bytes)
+{
+  static const char zeros[OTC_CACHE_ALIGN] = { 0 };
+  const uint64_t pad = align(bytes) - bytes;
+  if((bytes && fwrite(data, bytes, 1, w.f) != 1) ||
+     (pad && fwrite(zeros, pad, 1, w.f) != 1)){
+    fprintf(stderr, "Failed writing cache: %s\n", strerror(errno));
+    exit(1);
+  }
+  w.pos += bytes + pad;
+}
+
+void otc_cache_create(otc_cache_writer & w, const char * const filename,
+                      const bool clobber)
+{
+  const int fd =
+    open(filename, O_WRONLY | O_CREAT | (clobber? O_TRUNC: O_EXCL), 0644);
+  if(fd < 0 || !(w.f = fdopen(fd, "wb"))){
+    fprintf(stderr, "Could not open cache file %s: %s.  Use -c to "
+            "overwrite an existing one.\n", filename, strerror(errno));
+    exit(1);
+  }
+
+  // The header is written again at the end with everything filled in
+  w.pos = 0;
+  w.index.clear();
+  w.inputs.clear();
+  w.inputnames.clear();
+  memset(&w.header, 0, sizeof w.header);
+  memcpy(w.header.magic, CACHEMAGIC, sizeof CACHEMAGIC);
+  put(w, &w.header, sizeof w.header);
+}
+
+void otc_cache_write_batch(otc_cache_writer & w, const otc_event_batch & b)
+{
+  if(!b.ChNum || !b.Status || !b.Q || !b.Time || !b.xy_nhit || !b.xy_hits){
+    fprintf(stderr, "Asked to cache a batch without all columns\n");
+    exit(1);
+  }
+  if(b.first != w.header.nevent){
+    fprintf(stderr, "Asked to cache event %lu after event %lu\n",
+            (unsigned long)b.first, (unsigned long)w.header.nevent - 1);
+    exit(1);
+  }
+
+  // Make the offsets count from the first hit and overlap of the batch,
+  // which need not be the first in its columns.
+  const unsigned int hit0 = b.hitoffset[0], xy0 = b.xyoffset[0];
+  std::vector<unsigned int> hitoffset(b.n+1), xyoffset(b.n+1);
+  for(unsigned int i = 0; i <= b.n; i++){
+    hitoffset[i] = b.hitoffset[i] - hit0;
+    xyoffset[i] = b.xyoffset[i] - xy0;
+  }
+
+  otc_cache_block h;
+  memset(&h, 0, sizeof h);
+  h.first = b.first;
+  h.n = b.n;
+  h.nhit = hitoffset[b.n];
+  h.nxy = xyoffset[b.n];
+
+  const otc_cache_index where = { b.first, w.pos };
+  w.index.push_back(where);
+
+  put(w, &h, sizeof h);
+  put(w, &hitoffset[0], (b.n+1)*sizeof(unsigned int));
+  put(w, b.ChNum + hit0, h.nhit*sizeof *b.ChNum);
+  put(w, b.Status + hit0, h.nhit*sizeof *b.Status);
+  put(w, b.Q + hit0, h.nhit*sizeof *b.Q);
+  put(w, b.Time + hit0, h.nhit*sizeof *b.Time);
+  put(w, &xyoffset[0], (b.n+1)*sizeof(unsigned int));
+  put(w, b.xy_nhit + xy0, h.nxy*sizeof *b.xy_nhit);
+  put(w, b.xy_hits + xy0, h.nxy*sizeof *b.xy_hits);
+  put(w, b.readok, b.n*sizeof *b.readok);
+
+  w.header.nevent += b.n;
+  w.header.nblock++;
+}
+
+void otc_cache_add_input(otc_cache_writer & w, const char * const name,
+                         otc_cache_input in)
+{
+  in.nameoffset = w.inputnames.size();
+  w.inputs.push_back(in);
+  w.inputnames.insert(w.inputnames.end(), name, name + strlen(name) + 1);
+}
+
+void otc_cache_finish(otc_cache_writer & w)
+{
+  w.header.indexoffset = w.pos;
+  if(!w.index.empty())
+    put(w, &w.index[0], w.index.size()*sizeof w.index[0]);
+
+  w.header.ninput = w.inputs.size();
+  w.header.inputoffset = w.pos;
+  if(!w.inputs.empty()){
+    put(w, &w.inputs[0], w.inputs.size()*sizeof w.inputs[0]);
+    put(w, &w.inputnames[0], w.inputnames.size());
+  }
+
+  if(fseek(w.f, 0, SEEK_SET) ||
+     fwrite(&w.header, sizeof w.header, 1, w.f) != 1 || fclose(w.f)){
+    fprintf(stderr, "Failed writing cache: %s\n", strerror(errno));
+    exit(1);
+  }
+  w.f = NULL;
+}
+
+/* Whether the n+1 offsets into a column of 'count' elements start at
+zero, never go down and end at the end of the column */
+static bool offsets_ok(const unsigned int * const offset, const uint32_t n,
+                       const uint32_t count)
+{
+  if(offset[0] != 0 || offset[n] != count) return false;
+  for(uint32_t i = 0; i < n; i++)
+    if(offset[i+1] < offset[i]) return false;
+  return true;
+}
+
+uint64_t otc_cache_open(otc_cache & c, const char * const filename)
+{
+  memset(&c, 0, sizeof c);
+
+  c.fd = open(filename, O_RDONLY);
+  struct stat st;
+  if(c.fd < 0 || fstat(c.fd, &st)){
+    fprintf(stderr, "Could not open cache %s: %s\n", filename,
+            strerror(errno));
+    exit(1);
+  }
+  c.mapsize = st.st_size;
+
+  if(c.mapsize < sizeof(otc_cache_header)){
+    fprintf(stderr, "%s is not an otc cache file\n", filename);
+    exit(1);
+  }
+
+  void * const map = mmap(NULL, c.mapsize, PROT_READ, MAP_SHARED, c.fd, 0);
+  if(map == MAP_FAILED){
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  c.map = static_cast<const char *>(map);
+  c.header = reinterpret_cast<const otc_cache_header *>(c.map);
+
+  const otc_cache_header & h = *c.header;
+  if(memcmp(h.magic, CACHEMAGIC, sizeof CACHEMAGIC)){
+    fprintf(stderr, "%s is not an otc cache file\n", filename);
+    exit(1);
+  }
+  if(h.indexoffset > c.mapsize ||
+     h.nblock > (c.mapsize - h.indexoffset)/sizeof(otc_cache_index)){
+    fprintf(stderr, "%s is truncated\n", filename);
+    exit(1);
+  }
+  c.index = reinterpret_cast<const otc_cache_index *>(c.map + h.indexoffset);
+
+  if(h.inputoffset > c.mapsize ||
+     h.ninput > (c.mapsize - h.inputoffset)/sizeof(otc_cache_input)){
+    fprintf(stderr, "%s is truncated\n", filename);
+    exit(1);
+  }
+  c.inputs = reinterpret_cast<const otc_cache_input *>(c.map + h.inputoffset);
+  c.inputnames = reinterpret_cast<const char *>(c.inputs + h.ninput);
+  const uint64_t namebytes = c.map + c.mapsize - c.inputnames;
+  for(uint64_t i = 0; i < h.ninput; i++){
+    if(c.inputs[i].nameoffset >= namebytes ||
+       !memchr(c.inputnames + c.inputs[i].nameoffset, '\0',
+               namebytes - c.inputs[i].nameoffset)){
+      fprintf(stderr, "%s has a bad list of input files\n", filename);
+      exit(1);
+    }
+  }
+
+  // Check that every block is where the index says, holds the events
+  // it should, fits in the file, and has offsets that stay within its
+  // columns, so that nothing need be checked when reading events.
+  uint64_t nevent = 0;
+  for(uint64_t i = 0; i < h.nblock; i++){
+    const uint64_t pos = c.index[i].offset;
+    if(pos % OTC_CACHE_ALIGN || pos > c.mapsize - sizeof(otc_cache_block)){
+      fprintf(stderr, "%s has a bad index\n", filename);
+      exit(1);
+    }
+    const otc_cache_block & b =
+      *reinterpret_cast<const otc_cache_block *>(c.map + pos);
+    uint64_t off[NARRAY];
+    const uint64_t size = block_layout(b, off);
+    const unsigned int * const hitoffset =
+      reinterpret_cast<const unsigned int *>(c.map + pos + off[HITOFFSET]);
+    const unsigned int * const xyoffset =
+      reinterpret_cast<const unsigned int *>(c.map + pos + off[XYOFFSET]);
+    if(b.first != nevent || c.index[i].first != nevent ||
+       size > c.mapsize - pos ||
+       !offsets_ok(hitoffset, b.n, b.nhit) ||
+       !offsets_ok(xyoffset, b.n, b.nxy)){
+      fprintf(stderr, "%s is damaged at event %lu\n", filename,
+              (unsigned long)nevent);
+      exit(1);
+    }
+    nevent += b.n;
+  }
+
+  if(nevent != h.nevent){
+    fprintf(stderr, "%s should have %lu events, but has %lu\n", filename,
+            (unsigned long)h.nevent, (unsigned long)nevent);
+    exit(1);
+  }
+  return nevent;
+}
+
+unsigned int otc_cache_get_batch(const otc_cache & c, otc_event_batch & b,
+                                 const uint64_t first,
+                                 const unsigned int nwanted)
+{
+  if(first >= c.header->nevent) return 0;
+
+  // The last block starting at or before 'first'
+  uint64_t lo = 0, hi = c.header->nblock;
+  while(hi - lo > 1){
+    const uint64_t mid = (lo + hi)/2;
+    if(c.index[mid].first <= first) lo = mid;
+    else hi = mid;
+  }
+
+  const char * const block = c.map + c.index[lo].offset;
+  const otc_cache_block & h = *reinterpret_cast<const otc_cache_block *>(block);
+  uint64_t off[NARRAY];
+  block_layout(h, off);
+
+  const unsigned int i = first - h.first;
+  const unsigned int n = h.n - i < nwanted? h.n - i: nwanted;
+
+  // The offsets of event i onward still count from the start of the
+  // block, so the hit and overlap columns start there too.
+  b.first = first;
+  b.n = n;
+  b.hitoffset = reinterpret_cast<const unsigned int *>(block+off[HITOFFSET])+i;
+  b.ChNum     = reinterpret_cast<const unsigned int *>(block+off[CHNUM]);
+  b.Status    = reinterpret_cast<const unsigned short *>(block+off[STATUS]);
+  b.Q         = reinterpret_cast<const int *>(block+off[Q]);
+  b.Time      = reinterpret_cast<const int *>(block+off[TIME]);
+  b.xyoffset  = reinterpret_cast<const unsigned int *>(block+off[XYOFFSET])+i;
+  b.xy_nhit   = reinterpret_cast<const int *>(block+off[XYNHIT]);
+  b.xy_hits   = reinterpret_cast<const int (*)[OTC_MAXXYHIT]>(block+off[XYHITS]);
+  b.readok    = reinterpret_cast<const bool *>(block+off[READOK])+i;
+  return n;
+}
+
+void otc_cache_close(otc_cache & c)
+{
+  munmap(const_cast<char *>(c.map), c.mapsize);
+  close(c.fd);
+  c.map = NULL;
+}
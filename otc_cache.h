@@ -0,0 +1,128 @@
+/**
+  \author Matthew Strait
+  \brief Binary cache of the input hit and XY overlap columns.
+
+  Reading muon.root files means opening them, decompressing them and
+  converting the doubles in them to integers, all of which is the same
+  every time otc is run on the same files. A cache file holds the
+  result: a series of blocks, each one a batch of consecutive events
+  stored exactly as in an otc_event_batch. It is read by mapping it
+  into memory, and batches taken from it point straight into the map,
+  so there is nothing to do to read an event but look at it.
+
+  The cache also records the muon.root files it was made from, as they
+were then, so that a cache that no longer matches them isn't used.
+
+  Nothing here needs ROOT. Numbers are stored in the native byte order.
+*/
+
+#ifndef OTC_CACHE_H
+#define OTC_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "otc_cont.h"
+
+struct otc_cache_header {
+  /// "OTCHITC2". The last character changes if the layout does.
+  char magic[8];
+
+  /// Total number of events, and number of blocks they are in
+  uint64_t nevent, nblock;
+
+  /// Byte offset of the block index from the start of the file
+  uint64_t indexoffset;
+
+  /// Number of input files, and byte offset of their list, which is
+  /// followed by their names
+  uint64_t ninput, inputoffset;
+};
+
+/// One of the muon.root files a cache was made from, as it was then
+struct otc_cache_input {
+  /// mtime is in nanoseconds. hash is of the trees' headers, as used
+  /// for --manifest.
+  uint64_t size, mtime, hash;
+
+  /// Where its name is, counting from the end of the list of inputs.
+  /// Names are null-terminated.
+  uint64_t nameoffset;
+};
+
+/// Where each block is. The index is in order of event number.
+struct otc_cache_index {
+  /// Event number of the block's first event
+  uint64_t first;
+
+  /// Byte offset of the block from the start of the file
+  uint64_t offset;
+};
+
+/// The start of each block. After it come the block's columns in the
+/// order of otc_event_batch, each starting at a multiple of
+/// OTC_CACHE_ALIGN: hitoffset[n+1], ChNum[nhit], Status[nhit],
+/// Q[nhit], Time[nhit], xyoffset[n+1], xy_nhit[nxy], xy_hits[nxy] and
+/// readok[n]. Offsets count from the start of the block's own columns.
+struct otc_cache_block {
+  uint64_t first;
+  uint32_t n, nhit, nxy;
+  uint32_t unused; // to keep the size a multiple of 8
+};
+
+const uint64_t OTC_CACHE_ALIGN = 32;
+
+/// A cache file being written
+struct otc_cache_writer {
+  FILE * f;
+  uint64_t pos; // bytes written so far
+  otc_cache_header header;
+  std::vector<otc_cache_index> index;
+  std::vector<otc_cache_input> inputs;
+  std::vector<char> inputnames;
+};
+
+/// A cache file mapped for reading
+struct otc_cache {
+  int fd;
+  const char * map;
+  size_t mapsize;
+  const otc_cache_header * header;
+  const otc_cache_index * index;
+  const otc_cache_input * inputs;
+  const char * inputnames;
+};
+
+/// Start writing a cache file. Unless 'clobber', fails if the file
+/// exists. Exits on failure.
+void otc_cache_create(otc_cache_writer & w, const char * const filename,
+                      const bool clobber);
+
+/// Add the events in b as one block. They must follow the events
+/// already written, and all of b's columns must be present.
+void otc_cache_write_batch(otc_cache_writer & w, const otc_event_batch & b);
+
+/// Record that the cache is made from this file, which was as described
+/// by in, whose nameoffset is filled in here.
+void otc_cache_add_input(otc_cache_writer & w, const char * const name,
+                         otc_cache_input in);
+
+/// Write the index and finish the file. Exits on failure.
+void otc_cache_finish(otc_cache_writer & w);
+
+/// Map a cache file for reading, and return the number of events in
+/// it. Exits if it is not a good cache file. Everything in it is
+/// checked here, so nothing is when events are read.
+uint64_t otc_cache_open(otc_cache & c, const char * const filename);
+
+/// Point b at up to nwanted events starting with 'first'. Like
+/// get_batch() for ROOT files, but nothing is copied. Returns the
+/// number of events, which is fewer than asked for at the end of a
+/// block, or zero if 'first' is not in the cache.
+unsigned int otc_cache_get_batch(const otc_cache & c, otc_event_batch & b,
+                                 const uint64_t first,
+                                 const unsigned int nwanted);
+
+void otc_cache_close(otc_cache & c);
+
+#endif
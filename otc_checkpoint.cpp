@@ -0,0 +1,143 @@
+/**
+  \author Matthew Strait
+  \brief Records of how far a run got, for picking it up again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include "otc_checkpoint.h"
+
+static const char CHECKPOINTMAGIC[] = "otc checkpoint 1";
+
+static void write_state(FILE * const f, const char * const name,
+                        const otc_checkpoint_state & s)
+{
+  fprintf(f, "%s %lu %lu %lu %lu %lu %lu %lu %u %u %u\n", name,
+          (unsigned long)s.next, (unsigned long)s.nrow,
+          (unsigned long)s.nsummary, (unsigned long)s.summary.first,
+          (unsigned long)s.summary.end, (unsigned long)s.summary.sumnhitup,
+          (unsigned long)s.summary.sumnhitlo, s.summary.nevent,
+          s.summary.maxnhitup, s.summary.maxnhitlo);
+}
+
+void otc_checkpoint_write(const char * const filename,
+                          const otc_checkpoint & c)
+{
+  // Written beside the old one and renamed over it, so that there is
+  // always a whole checkpoint file no matter when we are killed
+  char tmpname[PATH_MAX];
+  snprintf(tmpname, sizeof tmpname, "%s.tmp", filename);
+
+  FILE * const f = fopen(tmpname, "w");
+  if(!f){
+    fprintf(stderr, "Could not open %s to write checkpoint: %s\n", tmpname,
+            strerror(errno));
+    exit(1);
+  }
+
+  fprintf(f, "%s\n", CHECKPOINTMAGIC);
+  fprintf(f, "first %lu\nend %lu\nsparse %d\n", (unsigned long)c.first,
+          (unsigned long)c.end, c.sparse);
+  for(int i = 0; i < c.ninput; i++) fprintf(f, "input %s\n", c.inputs[i]);
+  write_state(f, "done", c.done);
+  if(c.haspending) write_state(f, "pending", c.pending);
+
+  const bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if(fclose(f) || !ok || rename(tmpname, filename)){
+    fprintf(stderr, "Failed writing checkpoint to %s: %s\n", filename,
+            strerror(errno));
+    exit(1);
+  }
+}
+
+/* Read a state from the rest of a line after its name. Returns false
+if it doesn't make sense. */
+static bool read_state(const char * const line, otc_checkpoint_state & s)
+{
+  unsigned long next, nrow, nsummary, first, end, sumnhitup, sumnhitlo;
+  unsigned int nevent, maxnhitup, maxnhitlo;
+  if(sscanf(line, "%lu %lu %lu %lu %lu %lu %lu %u %u %u", &next, &nrow,
+            &nsummary, &first, &end, &sumnhitup, &sumnhitlo, &nevent,
+            &maxnhitup, &maxnhitlo) != 10) return false;
+
+  memset(&s, 0, sizeof s);
+  s.next = next;
+  s.nrow = nrow;
+  s.nsummary = nsummary;
+  s.summary.first = first;
+  s.summary.end = end;
+  s.summary.sumnhitup = sumnhitup;
+  s.summary.sumnhitlo = sumnhitlo;
+  s.summary.nevent = nevent;
+  s.summary.maxnhitup = maxnhitup;
+  s.summary.maxnhitlo = maxnhitlo;
+  return true;
+}
+
+void otc_checkpoint_read(const char * const filename, otc_checkpoint & c)
+{
+  FILE * const f = fopen(filename, "r");
+  if(!f){
+    fprintf(stderr, "Could not open checkpoint file %s: %s\n", filename,
+            strerror(errno));
+    exit(1);
+  }
+
+  char line[PATH_MAX + 64];
+  if(!fgets(line, sizeof line, f) ||
+     strncmp(line, CHECKPOINTMAGIC, sizeof CHECKPOINTMAGIC - 1)){
+    fprintf(stderr, "%s is not an otc checkpoint file\n", filename);
+    exit(1);
+  }
+
+  unsigned long first = 0, end = 0;
+  int sparse = 0, ninput = 0;
+  bool gotdone = false, bad = false;
+  c.haspending = false;
+
+  while(!bad && fgets(line, sizeof line, f)){
+    line[strcspn(line, "\n")] = '\0';
+    if(!strncmp(line, "first ", 6))
+      bad = sscanf(line + 6, "%lu", &first) != 1;
+    else if(!strncmp(line, "end ", 4))
+      bad = sscanf(line + 4, "%lu", &end) != 1;
+    else if(!strncmp(line, "sparse ", 7))
+      bad = sscanf(line + 7, "%d", &sparse) != 1;
+    else if(!strncmp(line, "input ", 6)){
+      if(ninput >= c.ninput || strcmp(line + 6, c.inputs[ninput])){
+        fprintf(stderr, "%s was for different input files. Give the same "
+                "ones, in the same order, to resume.\n", filename);
+        exit(1);
+      }
+      ninput++;
+    }
+    else if(!strncmp(line, "done ", 5))
+      bad = !(gotdone = read_state(line + 5, c.done));
+    else if(!strncmp(line, "pending ", 8))
+      bad = !(c.haspending = read_state(line + 8, c.pending));
+    else bad = true;
+  }
+  fclose(f);
+
+  if(bad || !gotdone){
+    fprintf(stderr, "%s is damaged\n", filename);
+    exit(1);
+  }
+
+  if(ninput != c.ninput){
+    fprintf(stderr, "%s was for different input files. Give the same "
+            "ones, in the same order, to resume.\n", filename);
+    exit(1);
+  }
+
+  if(first != c.first || end != c.end || bool(sparse) != c.sparse){
+    fprintf(stderr, "%s was for events %lu through %lu%s. Give the same "
+            "range of events and --sparse setting to resume.\n", filename,
+            first, end - 1, sparse? " in sparse mode": "");
+    exit(1);
+  }
+}
@@ -0,0 +1,62 @@
+/**
+  \author Matthew Strait
+  \brief Records of how far a run got, for picking it up again.
+
+  With --checkpoint, a small text file sits next to the output saying
+  what the run is reading and which events the output holds as of its
+  last checkpoint, so that a run that is stopped or killed can be
+  carried on with --resume and end up with the same output it would
+  have had.
+
+  Making the output safe and recording that it was done can't be one
+  step, so while a checkpoint is being made the file also says what the
+  output will hold once it is. Whichever of the two the output turns
+  out to hold is the one to carry on from.
+*/
+
+#ifndef OTC_CHECKPOINT_H
+#define OTC_CHECKPOINT_H
+
+#include <stdint.h>
+#include "otc_cont.h"
+
+/// How far the output got
+struct otc_checkpoint_state {
+  /// The first event not yet processed
+  uint64_t next;
+
+  /// Number of events and range summaries written to the output
+  uint64_t nrow, nsummary;
+
+  /// In sparse mode, the summary of the range being worked through,
+  /// which isn't in the output yet
+  otc_range_summary summary;
+};
+
+/// Everything in a checkpoint file. The inputs, range of events and
+/// sparseness must be the same for a run to be resumed.
+struct otc_checkpoint {
+  /// The muon.root files, or whatever else events are read from
+  const char * const * inputs;
+  int ninput;
+
+  uint64_t first, end;
+  bool sparse;
+
+  /// As of the last complete checkpoint, and, if 'haspending', the one
+  /// being made
+  otc_checkpoint_state done, pending;
+  bool haspending;
+};
+
+/// Write c to filename, replacing what was there in one step, and
+/// don't return until it is on disk. Exits on failure.
+void otc_checkpoint_write(const char * const filename,
+                          const otc_checkpoint & c);
+
+/// Read the states in filename into c, whose inputs, range and
+/// sparseness must already be filled in and match the file's. Exits if
+/// they don't or the file can't be read.
+void otc_checkpoint_read(const char * const filename, otc_checkpoint & c);
+
+#endif
@@ -0,0 +1,301 @@
+/**
+  \author Matthew Strait
+  \brief Memory-mappable columnar output files.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otc_colfile.h"
+
+static const char COLMAGIC[8] = { 'O', 'T', 'C', 'C', 'O', 'L', 'S', '2' };
+
+// Names, types and widths of the columns, in otc_colindex order
+static const struct {
+  const char * name;
+  otc_coltype type;
+  uint32_t width;
+} coldefs[OTC_COLF_NCOL] = {
+  { "length", OTC_COLTYPE_INT32,   4 },
+  { "lastx",  OTC_COLTYPE_FLOAT32, 4 },
+  { "lasty",  OTC_COLTYPE_FLOAT32, 4 },
+  { "lastz",  OTC_COLTYPE_FLOAT32, 4 },
+  { "error",  OTC_COLTYPE_BOOL8,   1 },
+  { "nhitup", OTC_COLTYPE_INT32,   4 },
+  { "nhitlo", OTC_COLTYPE_INT32,   4 },
+  { "event",  OTC_COLTYPE_UINT64,  8 },
+};
+
+static uint64_t align(const uint64_t n)
+{
+  return (n + OTC_COLFILE_ALIGN - 1) & ~(OTC_COLFILE_ALIGN - 1);
+}
+
+/* Fill in the column descriptions in h for a file of nevent events and
+nsummary summaries and return the size of the whole file. */
+static uint64_t layout(otc_colfile_header & h, const uint64_t nevent,
+                       const uint64_t nsummary)
+{
+  uint64_t offset = align(sizeof h);
+  for(int c = 0; c < OTC_COLF_NCOL; c++){
+    otc_colfile_column & col = h.columns[c];
+    memset(col.name, 0, sizeof col.name);
+    strncpy(col.name, coldefs[c].name, sizeof col.name - 1);
+    col.type = coldefs[c].type;
+    col.width = coldefs[c].width;
+    col.offset = offset;
+    offset = align(offset + nevent*col.width);
+  }
+  h.summaryoffset = offset;
+  return align(offset + nsummary*sizeof(otc_range_summary));
+}
+
+/* Point f's columns at where the header says they are */
+static void find_columns(otc_colfile & f)
+{
+  const otc_colfile_column * const c = f.header->columns;
+  f.length = reinterpret_cast<int32_t *>(f.map + c[OTC_COLF_LENGTH].offset);
+  f.lastx  = reinterpret_cast<float *>  (f.map + c[OTC_COLF_LASTX].offset);
+  f.lasty  = reinterpret_cast<float *>  (f.map + c[OTC_COLF_LASTY].offset);
+  f.lastz  = reinterpret_cast<float *>  (f.map + c[OTC_COLF_LASTZ].offset);
+  f.error  = reinterpret_cast<uint8_t *>(f.map + c[OTC_COLF_ERROR].offset);
+  f.nhitup = reinterpret_cast<int32_t *>(f.map + c[OTC_COLF_NHITUP].offset);
+  f.nhitlo = reinterpret_cast<int32_t *>(f.map + c[OTC_COLF_NHITLO].offset);
+  f.event  = reinterpret_cast<uint64_t *>(f.map + c[OTC_COLF_EVENT].offset);
+  f.summary = reinterpret_cast<otc_range_summary *>
+    (f.map + f.header->summaryoffset);
+}
+
+void otc_colfile_create(otc_colfile & f, const char * const filename,
+                        const bool clobber, const uint64_t firstevent,
+                        const uint64_t capacity,
+                        const uint64_t summarycapacity)
+{
+  memset(&f, 0, sizeof f);
+
+  f.fd = open(filename, O_RDWR | O_CREAT | (clobber? O_TRUNC: O_EXCL), 0644);
+  if(f.fd < 0){
+    fprintf(stderr, "Could not open output file %s: %s.  Use -c to "
+            "overwrite existing output.\n", filename, strerror(errno));
+    exit(1);
+  }
+
+  otc_colfile_header h;
+  memset(&h, 0, sizeof h);
+  f.mapsize = layout(h, capacity, summarycapacity);
+
+  // Get all the space now so that running out of disk is an error here
+  // rather than a SIGBUS when writing to the map later.
+  const int err = posix_fallocate(f.fd, 0, f.mapsize);
+  if(err){
+    fprintf(stderr, "Could not make %s %lu bytes long: %s\n", filename,
+            (unsigned long)f.mapsize, strerror(err));
+    exit(1);
+  }
+
+  void * const map =
+    mmap(NULL, f.mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, f.fd, 0);
+  if(map == MAP_FAILED){
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  f.map = static_cast<char *>(map);
+  f.capacity = capacity;
+  f.summarycapacity = summarycapacity;
+
+  f.header = reinterpret_cast<otc_colfile_header *>(f.map);
+  *f.header = h;
+  memcpy(f.header->magic, COLMAGIC, sizeof COLMAGIC);
+  f.header->firstevent = firstevent;
+  f.header->ncolumn = OTC_COLF_NCOL;
+  f.header->headersize = sizeof h;
+
+  find_columns(f);
+}
+
+void otc_colfile_write(otc_colfile & f, const otc_output_event & out)
+{
+  const uint64_t i = f.header->nevent;
+  if(i >= f.capacity){
+    fprintf(stderr, "Columnar output is full at %lu events\n",
+            (unsigned long)f.capacity);
+    exit(1);
+  }
+  f.length[i] = out.length;
+  f.lastx[i] = out.lastx;
+  f.lasty[i] = out.lasty;
+  f.lastz[i] = out.lastz;
+  f.error[i] = out.error;
+  f.nhitup[i] = out.nhitup;
+  f.nhitlo[i] = out.nhitlo;
+  f.event[i] = out.event;
+  f.header->nevent = i + 1;
+}
+
+void otc_colfile_write_summary(otc_colfile & f, const otc_range_summary & s)
+{
+  const uint64_t i = f.header->nsummary;
+  if(i >= f.summarycapacity){
+    fprintf(stderr, "Columnar output is full at %lu summaries\n",
+            (unsigned long)f.summarycapacity);
+    exit(1);
+  }
+  f.summary[i] = s;
+  f.header->nsummary = i + 1;
+}
+
+void otc_colfile_finish(otc_colfile & f)
+{
+  otc_colfile_header & h = *f.header;
+  uint64_t size = f.mapsize;
+
+  // Each column, and then the summaries, moves down by at least as much
+  // as the one before it does, so going in order never overwrites
+  // anything not yet moved.
+  if(h.nevent < f.capacity || h.nsummary < f.summarycapacity){
+    otc_colfile_header packed = h;
+    size = layout(packed, h.nevent, h.nsummary);
+    for(int c = 0; c < OTC_COLF_NCOL; c++)
+      memmove(f.map + packed.columns[c].offset, f.map + h.columns[c].offset,
+              h.nevent*h.columns[c].width);
+    memmove(f.map + packed.summaryoffset, f.map + h.summaryoffset,
+            h.nsummary*sizeof(otc_range_summary));
+    h = packed;
+  }
+
+  bool ok = msync(f.map, f.mapsize, MS_SYNC) == 0;
+  munmap(f.map, f.mapsize);
+  ok = ok && ftruncate(f.fd, size) == 0;
+  ok = close(f.fd) == 0 && ok;
+  if(!ok){
+    fprintf(stderr, "Failed writing columnar output: %s\n", strerror(errno));
+    exit(1);
+  }
+  f.map = NULL;
+  f.header = NULL;
+}
+
+void otc_colfile_sync(otc_colfile & f)
+{
+  if(msync(f.map, f.mapsize, MS_SYNC)){
+    fprintf(stderr, "Failed writing columnar output: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+bool otc_colfile_reopen(otc_colfile & f, const char * const filename,
+                        const uint64_t firstevent, const uint64_t capacity,
+                        const uint64_t summarycapacity,
+                        const uint64_t nevent, const uint64_t nsummary)
+{
+  memset(&f, 0, sizeof f);
+
+  f.fd = open(filename, O_RDWR);
+  struct stat st;
+  if(f.fd < 0 || fstat(f.fd, &st)){
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+
+  // A finished file has been packed down to what was written, so it
+  // won't be the size it started out as
+  otc_colfile_header h;
+  memset(&h, 0, sizeof h);
+  f.mapsize = layout(h, capacity, summarycapacity);
+  if(uint64_t(st.st_size) != f.mapsize){
+    close(f.fd);
+    return false;
+  }
+
+  void * const map =
+    mmap(NULL, f.mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, f.fd, 0);
+  if(map == MAP_FAILED){
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  f.map = static_cast<char *>(map);
+  f.header = reinterpret_cast<otc_colfile_header *>(f.map);
+
+  const otc_colfile_header & old = *f.header;
+  if(memcmp(old.magic, COLMAGIC, sizeof COLMAGIC) ||
+     old.ncolumn != OTC_COLF_NCOL || old.headersize != sizeof old ||
+     old.firstevent != firstevent || old.summaryoffset != h.summaryoffset ||
+     memcmp(old.columns, h.columns, sizeof h.columns) ||
+     old.nevent < nevent || old.nsummary < nsummary){
+    otc_colfile_close(f);
+    return false;
+  }
+
+  f.capacity = capacity;
+  f.summarycapacity = summarycapacity;
+  f.header->nevent = nevent;
+  f.header->nsummary = nsummary;
+  find_columns(f);
+  return true;
+}
+
+void otc_colfile_open(otc_colfile & f, const char * const filename)
+{
+  memset(&f, 0, sizeof f);
+
+  f.fd = open(filename, O_RDONLY);
+  struct stat st;
+  if(f.fd < 0 || fstat(f.fd, &st)){
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  f.mapsize = st.st_size;
+
+  if(f.mapsize < sizeof(otc_colfile_header)){
+    fprintf(stderr, "%s is not an otc columnar file\n", filename);
+    exit(1);
+  }
+
+  void * const map = mmap(NULL, f.mapsize, PROT_READ, MAP_SHARED, f.fd, 0);
+  if(map == MAP_FAILED){
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  f.map = static_cast<char *>(map);
+  f.header = reinterpret_cast<otc_colfile_header *>(f.map);
+
+  const otc_colfile_header & h = *f.header;
+  if(memcmp(h.magic, COLMAGIC, sizeof COLMAGIC) ||
+     h.ncolumn != OTC_COLF_NCOL || h.headersize != sizeof h){
+    fprintf(stderr, "%s is not an otc columnar file\n", filename);
+    exit(1);
+  }
+
+  for(int c = 0; c < OTC_COLF_NCOL; c++){
+    const otc_colfile_column & col = h.columns[c];
+    if(col.type != uint32_t(coldefs[c].type) ||
+       col.width != coldefs[c].width ||
+       col.offset > f.mapsize ||
+       h.nevent > (f.mapsize - col.offset)/col.width){
+      fprintf(stderr, "%s is truncated or has a bad %s column\n", filename,
+              coldefs[c].name);
+      exit(1);
+    }
+  }
+
+  if(h.summaryoffset > f.mapsize ||
+     h.nsummary > (f.mapsize - h.summaryoffset)/sizeof(otc_range_summary)){
+    fprintf(stderr, "%s is truncated\n", filename);
+    exit(1);
+  }
+
+  find_columns(f);
+}
+
+void otc_colfile_close(otc_colfile & f)
+{
+  munmap(f.map, f.mapsize);
+  close(f.fd);
+  f.map = NULL;
+  f.header = NULL;
+}
@@ -0,0 +1,149 @@
+/**
+  \author Matthew Strait
+  \brief Memory-mappable columnar output files.
+
+  An alternative to the ROOT output tree for those who only want otc's
+  answers by event number. The file is a header followed by one array
+  per output quantity, each with one fixed-width entry per event, so
+  that a reader can mmap the file and look at event N of any quantity
+  directly. In sparse mode, only some events are written, the event
+  column says which, and the rest are described by range summaries
+  after the columns. Nothing here needs ROOT, so readers can use this
+  file and otc_colfile.cpp without it.
+
+  All numbers are stored in the native byte order, which is to say
+  little-endian everywhere otc runs.
+*/
+
+#ifndef OTC_COLFILE_H
+#define OTC_COLFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "otc_cont.h"
+
+/// The types that a column can have
+enum otc_coltype {
+  OTC_COLTYPE_INT32 = 1,
+  OTC_COLTYPE_FLOAT32 = 2,
+  OTC_COLTYPE_BOOL8 = 3, // one byte, 0 or 1
+  OTC_COLTYPE_UINT64 = 4
+};
+
+/// The columns, in the order they appear in the file
+enum otc_colindex {
+  OTC_COLF_LENGTH,
+  OTC_COLF_LASTX,
+  OTC_COLF_LASTY,
+  OTC_COLF_LASTZ,
+  OTC_COLF_ERROR,
+  OTC_COLF_NHITUP,
+  OTC_COLF_NHITLO,
+  OTC_COLF_EVENT,
+  OTC_COLF_NCOL
+};
+
+/// Where each column's array starts is a multiple of this
+const uint64_t OTC_COLFILE_ALIGN = 64;
+
+struct otc_colfile_column {
+  /// Same as the name of the branch in the ROOT output, null-padded
+  char name[16];
+
+  /// An otc_coltype
+  uint32_t type;
+
+  /// Bytes per entry
+  uint32_t width;
+
+  /// Byte offset of the first entry from the start of the file
+  uint64_t offset;
+};
+
+struct otc_colfile_header {
+  /// "OTCCOLS2". The last character changes if the layout does.
+  char magic[8];
+
+  /// Number of events, i.e. entries in each column
+  uint64_t nevent;
+
+  /// Input event number of the first event processed. Unless the file
+  /// is sparse, entry i is input event firstevent + i.
+  uint64_t firstevent;
+
+  /// Number of otc_range_summary records, and the byte offset of the
+  /// first one from the start of the file. Zero unless sparse.
+  uint64_t nsummary, summaryoffset;
+
+  /// Number of columns described below, and the size of this header
+  uint32_t ncolumn, headersize;
+
+  otc_colfile_column columns[OTC_COLF_NCOL];
+};
+
+/// An open columnar file, for writing or reading. The column pointers
+/// point into the mapped file and are indexed by event.
+struct otc_colfile {
+  int fd;
+  char * map;
+  size_t mapsize;
+
+  // Number of events and summaries there is room for when writing
+  uint64_t capacity, summarycapacity;
+
+  otc_colfile_header * header;
+
+  int32_t * length;
+  float * lastx, * lasty, * lastz;
+  uint8_t * error;
+  int32_t * nhitup, * nhitlo;
+  uint64_t * event;
+
+  otc_range_summary * summary;
+};
+
+/// Create a columnar file with room for 'capacity' events and
+/// 'summarycapacity' range summaries, where the first event processed
+/// is input event 'firstevent'. Unless 'clobber', fails if the file
+/// exists. Exits on failure.
+void otc_colfile_create(otc_colfile & f, const char * const filename,
+                        const bool clobber, const uint64_t firstevent,
+                        const uint64_t capacity,
+                        const uint64_t summarycapacity);
+
+/// Add one event to a file from otc_colfile_create(). Exits if there is
+/// no room left.
+void otc_colfile_write(otc_colfile & f, const otc_output_event & out);
+
+/// Add one range summary to a file from otc_colfile_create(). Exits if
+/// there is no room left.
+void otc_colfile_write_summary(otc_colfile & f, const otc_range_summary & s);
+
+/// Finish a file from otc_colfile_create(). If fewer events or
+/// summaries were written than there was room for, everything is moved
+/// together so that no space is wasted. Exits on failure.
+void otc_colfile_finish(otc_colfile & f);
+
+/// Make sure everything written to a file from otc_colfile_create() so
+/// far is on disk. Exits on failure.
+void otc_colfile_sync(otc_colfile & f);
+
+/// Reopen a file that was made by otc_colfile_create() with the same
+/// arguments, written to, synced and never finished, to carry on
+/// writing it after its first nevent events and nsummary summaries.
+/// Anything written after those is dropped. Returns false, with
+/// nothing left open, if the file isn't laid out as it would have been
+/// or doesn't hold that many. Exits if it can't be opened.
+bool otc_colfile_reopen(otc_colfile & f, const char * const filename,
+                        const uint64_t firstevent, const uint64_t capacity,
+                        const uint64_t summarycapacity,
+                        const uint64_t nevent, const uint64_t nsummary);
+
+/// Map an existing columnar file read-only. Everything in 'f' is then
+/// good until otc_colfile_close(). Exits on failure.
+void otc_colfile_open(otc_colfile & f, const char * const filename);
+
+/// Unmap a file from otc_colfile_open().
+void otc_colfile_close(otc_colfile & f);
+
+#endif
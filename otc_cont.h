@@ -1,10 +1,43 @@
+#ifndef OTC_CONT_H
+#define OTC_CONT_H
+
+/// More hits than any sane event has. Events with more are still
+/// processed, but are complained about.
 const unsigned int MAXOVHITS = 64*60;
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct cart3{
   double x, y, z;
 };
 
-struct OVEventForReco {
+/// Largest number of XY overlaps and tracks that RecoOV should return
+/// for one event. Rather than contaminate most of the source here with
+/// DCRecoOV.hh and everything that it depends on (ROOT!), just copy
+/// this here.
+#define OTC_MAX_RECO_OV_OBJ 64
+#define OTC_MAXXYHIT 16
+
+/// The input columns, as bits so that a set of them can be given as a
+/// mask. Whether an event has hits or XY overlaps at all is always
+/// known; these are the things about each hit or overlap that can be
+/// read or not.
+enum otc_column {
+  OTC_COL_CHNUM  = 1 << 0,
+  OTC_COL_STATUS = 1 << 1,
+  OTC_COL_Q      = 1 << 2,
+  OTC_COL_TIME   = 1 << 3,
+  OTC_COL_XYNHIT = 1 << 4,
+  OTC_COL_XYHITS = 1 << 5,
+  OTC_COL_ALL    = (1 << 6) - 1
+};
+
+/// One event. It doesn't own any of its hits: the pointers go into
+/// memory belonging to whatever read the event, which is sized for
+/// this event alone, and only the first nhit hits and nxy overlaps
+/// exist.
+struct otc_event_view {
   /// Number of hits in this event
   unsigned int nhit;
 
@@ -13,11 +46,11 @@ struct OVEventForReco {
   /// efficiency, but generically it's the caller's responsiblity to
   /// make sure that the input is translated if it doesn't start out as
   /// four bytes.
-  unsigned int ChNum[MAXOVHITS];
+  const unsigned int * ChNum;
 
   /// The type of hit. Equal to 2 for ordinary hits and 4 for edge
   /// triggers.  See comments on size in ChNum.
-  unsigned short Status[MAXOVHITS];
+  const unsigned short * Status;
 
   /// The integrated ADC counts. As of this writing, these are stored
   /// in muon.root files as doubles (typedef DC::PE), but this does
@@ -26,7 +59,7 @@ struct OVEventForReco {
   /// integers with an eye towards having them be integers in the files
   /// in the future.  This way (new) RecoOV can be written to handle
   /// integers from now on.
-  int Q[MAXOVHITS];
+  const int * Q;
 
   /// The number of 16ns clock ticks since the last rollover. The clock
   /// rolls over every 2^29 ticks. This is currently stored in muon.root
@@ -34,30 +67,63 @@ struct OVEventForReco {
   /// typedef DC::T_ns, which also doesn't make sense, because it does
   /// not represent nanoseconds, but rather counts of 16ns. As above,
   /// I'm taking a stand and forcing conversion to integers here.
-  int Time[MAXOVHITS];
-};
+  const int * Time;
 
-/// Largest number of XY overlaps and tracks that RecoOV should return
-/// for one event. Rather than contaminate most of the source here with
-/// DCRecoOV.hh and everything that it depends on (ROOT!), just copy
-/// this here.
-#define OTC_MAX_RECO_OV_OBJ 64
-#define OTC_MAXXYHIT 16
-
-struct otc_input_event {
-  // All the hits
-  OVEventForReco hits;
-
-  // Number of XY overlaps in the Outer Veto
+  /// Number of XY overlaps in the Outer Veto
   int nxy;
 
-  // number of hits in each xy overlap
-  int xy_nhit[OTC_MAX_RECO_OV_OBJ];
+  /// Number of hits in each xy overlap
+  const int * xy_nhit;
 
-  // the hit indices 
-  int xy_hits[OTC_MAX_RECO_OV_OBJ][OTC_MAXXYHIT];
+  /// The hit indices
+  const int (* xy_hits)[OTC_MAXXYHIT];
 };
 
+/// Many consecutive events, with each quantity stored in one column for
+/// all of them. The hits of event i are elements hitoffset[i] through
+/// hitoffset[i+1]-1 of the hit columns, and its XY overlaps are
+/// likewise given by xyoffset.
+struct otc_event_batch {
+  /// Event number of the first event
+  uint64_t first;
+
+  /// Number of events
+  unsigned int n;
+
+  const unsigned int * hitoffset;
+  const unsigned int * ChNum;
+  const unsigned short * Status;
+  const int * Q;
+  const int * Time;
+
+  const unsigned int * xyoffset;
+  const int * xy_nhit;
+  const int (* xy_hits)[OTC_MAXXYHIT];
+
+  /// Whether each event was read without trouble. Events that weren't
+  /// may be missing hits or overlaps.
+  ///
+  /// Any of the hit or overlap columns may be null if it wasn't read.
+  const bool * readok;
+};
+
+/// Point ev at the i'th event of b. Columns that weren't read are null
+/// in b and in ev.
+static inline void otc_batch_event(otc_event_view & ev,
+                                   const otc_event_batch & b,
+                                   const unsigned int i)
+{
+  const unsigned int h = b.hitoffset[i], x = b.xyoffset[i];
+  ev.nhit    = b.hitoffset[i+1] - h;
+  ev.ChNum   = b.ChNum?   b.ChNum + h:   NULL;
+  ev.Status  = b.Status?  b.Status + h:  NULL;
+  ev.Q       = b.Q?       b.Q + h:       NULL;
+  ev.Time    = b.Time?    b.Time + h:    NULL;
+  ev.nxy     = b.xyoffset[i+1] - x;
+  ev.xy_nhit = b.xy_nhit? b.xy_nhit + x: NULL;
+  ev.xy_hits = b.xy_hits? b.xy_hits + x: NULL;
+}
+
 struct otc_output_event {
 
   // Out of strips hit in the last clock cycle, the coordinates of the
@@ -76,4 +142,30 @@ struct otc_output_event {
   // thereof.  Currently this means that there were un-time-ordered
   // hits in the input.
   bool error;
+
+  // Input event number. Only written out in sparse mode, where it is
+  // needed to know which event a row is.
+  uint64_t event;
 };
+
+// In sparse mode, events without XY overlaps or errors are not written
+// out one by one. Instead, their hit counts are summed up for each
+// range of events.
+struct otc_range_summary {
+  // The range covers input events first up to, but not including, end
+  uint64_t first, end;
+
+  // Sums of nhitup and nhitlo over the summarized events
+  uint64_t sumnhitup, sumnhitlo;
+
+  // Number of events summarized. The rest of the range was written out
+  // as rows.
+  uint32_t nevent;
+
+  // Largest nhitup and nhitlo among the summarized events
+  uint32_t maxnhitup, maxnhitlo;
+
+  uint32_t unused; // to keep the size a multiple of 8
+};
+
+#endif
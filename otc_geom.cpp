@@ -0,0 +1,127 @@
+/**
+  \author Matthew Strait
+  \brief Channel geometry table and its snapshot files.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "otc_geom.h"
+
+otc_stripgeom otc_geomtable[OTC_NGEOMKIND][OTC_MAXCHNUM];
+uint8_t otc_geomflags[OTC_NGEOMKIND*OTC_MAXCHNUM + 3];
+
+const otc_stripgeom otc_badchannel = { 0, 0, 0, 0, 0, false, false };
+
+// Identifies a geometry snapshot file and its layout. Change the last
+// character if the layout changes.
+static const char GEOMMAGIC[8] = { 'O', 'T', 'C', 'G', 'E', 'O', 'M', '1' };
+
+// One table entry as stored in a snapshot. The derived quantities are
+// not stored, but recomputed on loading.
+struct geomrecord {
+  uint32_t ch;
+  uint16_t kind;
+  uint16_t mod;
+  double x, y, z;
+};
+
+void otc_geom_set(const unsigned int ch, const otc_geomkind kind,
+                  const unsigned short mod,
+                  const double x, const double y, const double z)
+{
+  otc_stripgeom & g = otc_geomtable[kind][ch];
+  g.x = x;
+  g.y = y;
+  g.z = z;
+  g.r2 = x*x + y*y;
+  g.mod = mod;
+  g.valid = mod != 0;
+  g.upper = mod > 135;
+
+  otc_geomflags[kind*OTC_MAXCHNUM + ch] =
+    (g.valid? OTC_GEOM_VALID: 0) | (g.upper? OTC_GEOM_UPPER: 0);
+}
+
+// Most of the table is bad channel numbers with nothing in them, which
+// needn't be stored. Bad channels that have a strip center anyway (ZOE
+// gives the center of strip 0 of module 0) are kept so that a loaded
+// table is exactly the same as the one that was saved.
+static bool worth_saving(const otc_stripgeom & g)
+{
+  return g.valid || g.x != 0 || g.y != 0 || g.z != 0;
+}
+
+void otc_geom_save(const char * const filename)
+{
+  FILE * f = fopen(filename, "wb");
+  if(!f){
+    fprintf(stderr, "Could not open %s to write geometry\n", filename);
+    exit(1);
+  }
+
+  uint32_t nrecord = 0;
+  for(int k = 0; k < OTC_NGEOMKIND; k++)
+    for(unsigned int ch = 0; ch < OTC_MAXCHNUM; ch++)
+      if(worth_saving(otc_geomtable[k][ch])) nrecord++;
+
+  bool ok = fwrite(GEOMMAGIC, sizeof GEOMMAGIC, 1, f) == 1 &&
+            fwrite(&nrecord, sizeof nrecord, 1, f) == 1;
+
+  for(int k = 0; ok && k < OTC_NGEOMKIND; k++){
+    for(unsigned int ch = 0; ok && ch < OTC_MAXCHNUM; ch++){
+      const otc_stripgeom & g = otc_geomtable[k][ch];
+      if(!worth_saving(g)) continue;
+      geomrecord r;
+      memset(&r, 0, sizeof r);
+      r.ch = ch;
+      r.kind = k;
+      r.mod = g.mod;
+      r.x = g.x;
+      r.y = g.y;
+      r.z = g.z;
+      ok = fwrite(&r, sizeof r, 1, f) == 1;
+    }
+  }
+
+  if(fclose(f) || !ok){
+    fprintf(stderr, "Failed writing geometry to %s\n", filename);
+    exit(1);
+  }
+}
+
+void otc_geom_load(const char * const filename)
+{
+  FILE * f = fopen(filename, "rb");
+  if(!f){
+    fprintf(stderr, "Could not open geometry file %s\n", filename);
+    exit(1);
+  }
+
+  char magic[sizeof GEOMMAGIC];
+  uint32_t nrecord;
+  if(fread(magic, sizeof magic, 1, f) != 1 ||
+     memcmp(magic, GEOMMAGIC, sizeof magic) ||
+     fread(&nrecord, sizeof nrecord, 1, f) != 1){
+    fprintf(stderr, "%s is not an otc geometry file\n", filename);
+    exit(1);
+  }
+
+  memset(otc_geomtable, 0, sizeof otc_geomtable);
+  memset(otc_geomflags, 0, sizeof otc_geomflags);
+
+  for(uint32_t i = 0; i < nrecord; i++){
+    geomrecord r;
+    if(fread(&r, sizeof r, 1, f) != 1){
+      fprintf(stderr, "%s is truncated\n", filename);
+      exit(1);
+    }
+    if(r.ch >= OTC_MAXCHNUM || r.kind >= OTC_NGEOMKIND){
+      fprintf(stderr, "%s has a bad entry for channel %u\n", filename, r.ch);
+      exit(1);
+    }
+    otc_geom_set(r.ch, otc_geomkind(r.kind), r.mod, r.x, r.y, r.z);
+  }
+
+  fclose(f);
+}
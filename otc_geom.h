@@ -0,0 +1,100 @@
+/**
+  \author Matthew Strait
+  \brief Channel number to strip geometry lookup table.
+
+  Everything otc needs to know about where a hit is can be worked out
+  from its channel number and whether it is an ordinary hit or an edge
+  trigger, so it is all worked out once at startup and put in a flat
+  table indexed by channel number. After setup, the table is only read,
+  so it can be used from any number of threads at once.
+*/
+
+#ifndef OTC_GEOM_H
+#define OTC_GEOM_H
+
+#include <stdint.h>
+
+/// Channel numbers at or above this are not in the table and are
+/// treated as invalid. Trigger box channels start at 20000 and go up
+/// by 100 per box, so this leaves room for over a hundred boxes.
+const unsigned int OTC_MAXCHNUM = 0x8000;
+
+/// The ways in which a channel can be interpreted. These correspond
+/// to ZOE's normal, edgelow and edgehigh: an ordinary hit, or the lower
+/// or higher of the two strips that an edge trigger could be from.
+enum otc_geomkind {
+  OTC_NORMAL = 0,
+  OTC_EDGELOW = 1,
+  OTC_EDGEHIGH = 2,
+  OTC_NGEOMKIND = 3
+};
+
+struct otc_stripgeom {
+  /// The center of the strip
+  double x, y, z;
+
+  /// x*x + y*y, the square of the distance from the chimney
+  double r2;
+
+  /// Module number. Zero for bad channel numbers, as with ZOE.
+  unsigned short mod;
+
+  /// Whether the channel number is good, i.e. mod != 0
+  bool valid;
+
+  /// Whether this is in the upper OV, i.e. mod > 135
+  bool upper;
+};
+
+/// The table itself. Indexed first by kind so that all the ordinary
+/// hit entries, which are what almost every lookup wants, are together.
+extern otc_stripgeom otc_geomtable[OTC_NGEOMKIND][OTC_MAXCHNUM];
+
+/// Returned for channels not in the table
+extern const otc_stripgeom otc_badchannel;
+
+/// Bits of otc_geomflags
+enum {
+  OTC_GEOM_VALID = 1,
+  OTC_GEOM_UPPER = 2
+};
+
+/// The valid and upper flags of otc_geomtable, one byte per entry,
+/// indexed by kind*OTC_MAXCHNUM + channel. This is small enough to stay
+/// in cache and can be gathered four bytes at a time by vector code,
+/// for which there are three bytes of padding at the end.
+extern uint8_t otc_geomflags[OTC_NGEOMKIND*OTC_MAXCHNUM + 3];
+
+/// The kind of lookup that ZOE would have been asked for given a hit's
+/// status, which is 2 for ordinary hits and 4 for edge triggers.
+static inline otc_geomkind otc_kind(const unsigned short status,
+                                    const bool uselowiftrig)
+{
+  return status == 2? OTC_NORMAL: uselowiftrig? OTC_EDGELOW: OTC_EDGEHIGH;
+}
+
+static inline const otc_stripgeom & otc_geom(const unsigned int ch,
+                                             const otc_geomkind kind)
+{
+  return ch < OTC_MAXCHNUM? otc_geomtable[kind][ch]: otc_badchannel;
+}
+
+/// Set one table entry. x, y and z are the strip center. mod is zero
+/// for a bad channel number.
+void otc_geom_set(const unsigned int ch, const otc_geomkind kind,
+                  const unsigned short mod,
+                  const double x, const double y, const double z);
+
+/// Fill the table from ZOE. Defined in otc_geom_zoe.cpp so that
+/// nothing else needs ZOE to build.
+void otc_geom_from_zoe();
+
+/// Write the table to a file that otc_geom_load() can read back.
+/// Exits on failure.
+void otc_geom_save(const char * const filename);
+
+/// Fill the table from a file written by otc_geom_save(). Exits on
+/// failure.
+void otc_geom_load(const char * const filename);
+
+#endif
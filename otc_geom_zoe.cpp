@@ -0,0 +1,52 @@
+/**
+  \author Matthew Strait
+  \brief Fills the channel geometry table from ZOE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "otc_geom.h"
+
+#include "zcont.h"
+extern zdrawstrip ** striplinesabs;
+
+static const ztype zoekind[OTC_NGEOMKIND] = { normal, edgelow, edgehigh };
+
+void otc_geom_from_zoe()
+{
+  // ZOE prints a message for every bad channel number it is given, and
+  // most of the numbers we're about to ask about are bad, so send its
+  // output away while we do this.
+  fflush(stdout);
+  fflush(stderr);
+  const int devnull = open("/dev/null", O_WRONLY);
+  const int oldout = dup(1), olderr = dup(2);
+  if(devnull >= 0){
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+  }
+
+  for(int k = 0; k < OTC_NGEOMKIND; k++){
+    for(unsigned int ch = 0; ch < OTC_MAXCHNUM; ch++){
+      // Just using zhit for geometry, don't bother setting adc/tick/index
+      const zhit hit(ch, 0, 0, zoekind[k], 0);
+
+      // ZOE will return mod = stp = 0 for bad channel numbers
+      const zdrawstrip strip = striplinesabs[hit.mod][hit.stp];
+      otc_geom_set(ch, otc_geomkind(k), hit.mod,
+                   (strip.x1+strip.x2)/2, (strip.y1+strip.y2)/2, strip.z);
+    }
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  if(devnull >= 0){
+    dup2(oldout, 1);
+    dup2(olderr, 2);
+    close(devnull);
+  }
+  close(oldout);
+  close(olderr);
+}
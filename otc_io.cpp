@@ -0,0 +1,230 @@
+/**
+  \author Matthew Strait
+  \brief Event sources and sinks that don't need ROOT.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "otc_io.h"
+#include "otc_cache.h"
+#include "otc_colfile.h"
+#include "otc_synth.h"
+#include "otc_timing.h"
+
+/* The number of bytes of columns that b's events take up */
+static uint64_t batch_bytes(const otc_event_batch & b)
+{
+  const uint64_t nhit = b.hitoffset[b.n] - b.hitoffset[0],
+                 nxy = b.xyoffset[b.n] - b.xyoffset[0];
+  return b.n*(2*sizeof(unsigned int) + sizeof(bool)) +
+         nhit*(sizeof(unsigned int) + sizeof(unsigned short) + 2*sizeof(int)) +
+         nxy*(sizeof(int) + OTC_MAXXYHIT*sizeof(int));
+}
+
+namespace {
+  class cache_source : public otc_event_source {
+    public:
+    cache_source(const char * const filename,
+                 void (* check_inputs)(const otc_cache &, const char * const)):
+      bytes(0)
+    {
+      n = otc_cache_open(cache, filename);
+      if(check_inputs) check_inputs(cache, filename);
+    }
+
+    ~cache_source()
+    {
+      otc_cache_close(cache);
+    }
+
+    uint64_t nevent() const
+    {
+      return n;
+    }
+
+    unsigned int get_batch(otc_event_batch & b, const uint64_t first,
+                           const unsigned int nwanted,
+                           __attribute__((unused)) otc_arena & arena)
+    {
+      const uint64_t start = otc_timing_begin();
+      const unsigned int got = otc_cache_get_batch(cache, b, first, nwanted);
+      otc_timing_end(OTC_STAGE_READHITS, first, got, start);
+      if(got) bytes += batch_bytes(b);
+      return got;
+    }
+
+    uint64_t bytes_read() const
+    {
+      return bytes;
+    }
+
+    private:
+    otc_cache cache;
+    uint64_t n, bytes;
+  };
+
+  // Synthetic events are made in blocks of this many, each from its own
+  // seed, so that any event can be gotten to without making all the
+  // ones before it.
+  const unsigned int SYNTH_BLOCK = 1 << 12;
+
+  class synth_source : public otc_event_source {
+    public:
+    synth_source(const uint64_t nevent, const uint64_t seed):
+      n(nevent), seed(seed), next(UINT64_MAX), bytes(0) {}
+
+    uint64_t nevent() const
+    {
+      return n;
+    }
+
+    unsigned int get_batch(otc_event_batch & b, const uint64_t first,
+                           const unsigned int nwanted, otc_arena & arena)
+    {
+      if(first >= n) return 0;
+      const uint64_t start = otc_timing_begin();
+
+      const uint64_t blockfirst = first - first%SYNTH_BLOCK;
+      const uint64_t blockend = blockfirst + SYNTH_BLOCK < n?
+                                blockfirst + SYNTH_BLOCK: n;
+      const unsigned int got = blockend - first < nwanted?
+                               blockend - first: nwanted;
+
+      // Events are almost always read in order, in which case the
+      // generator is already where it needs to be. Otherwise, start
+      // the block over and make and throw away the events before
+      // 'first'.
+      if(first != next){
+        otc_synth_seed(gen, seed + (blockfirst/SYNTH_BLOCK << 32));
+        if(first != blockfirst){
+          otc_event_batch skipped;
+          otc_arena_reset(scratch);
+          otc_synth_batch(gen, skipped, blockfirst, first - blockfirst,
+                          scratch);
+        }
+      }
+
+      otc_synth_batch(gen, b, first, got, arena);
+      next = first + got == blockend? UINT64_MAX: first + got;
+      otc_timing_end(OTC_STAGE_READHITS, first, got, start);
+      bytes += batch_bytes(b);
+      return got;
+    }
+
+    // Counts what was made as if it had been read
+    uint64_t bytes_read() const
+    {
+      return bytes;
+    }
+
+    private:
+    uint64_t n, seed;
+
+    // The generator, and the event it makes next, if it is partway
+    // through a block
+    otc_synth gen;
+    uint64_t next;
+
+    // Where events made just to be skipped over go
+    otc_arena scratch;
+
+    uint64_t bytes;
+  };
+
+  class colfile_sink : public otc_event_sink {
+    public:
+    colfile_sink(const char * const filename, const bool clobber):
+      filename(filename), clobber(clobber)
+    {
+      // The file is only made once we know how big to make it, but
+      // don't make the user wait until then to find out it's in the way.
+      if(!clobber && access(filename, F_OK) == 0){
+        fprintf(stderr, "Output file %s already exists.  Use -c to "
+                "overwrite existing output.\n", filename);
+        exit(1);
+      }
+    }
+
+    void begin(const uint64_t first, const uint64_t end,
+               const uint64_t nsummary)
+    {
+      otc_colfile_create(f, filename, clobber, first, end - first, nsummary);
+    }
+
+    void write_event(const otc_output_event & out)
+    {
+      otc_colfile_write(f, out);
+    }
+
+    void write_summary(const otc_range_summary & s)
+    {
+      otc_colfile_write_summary(f, s);
+    }
+
+    void finish()
+    {
+      otc_colfile_finish(f);
+    }
+
+    void checkpoint()
+    {
+      otc_colfile_sync(f);
+    }
+
+    bool resume(const uint64_t first, const uint64_t end,
+                const uint64_t nsummarymax, const uint64_t nrow,
+                const uint64_t nsummary)
+    {
+      return otc_colfile_reopen(f, filename, first, end - first, nsummarymax,
+                                nrow, nsummary);
+    }
+
+    private:
+    const char * filename;
+    bool clobber;
+    otc_colfile f;
+  };
+
+  class null_sink : public otc_event_sink {
+    public:
+    void begin(__attribute__((unused)) const uint64_t first,
+               __attribute__((unused)) const uint64_t end,
+               __attribute__((unused)) const uint64_t nsummary) {}
+    void write_event(__attribute__((unused)) const otc_output_event & out) {}
+    void write_summary(__attribute__((unused)) const otc_range_summary & s) {}
+    void finish() {}
+    void checkpoint() {}
+    bool resume(__attribute__((unused)) const uint64_t first,
+                __attribute__((unused)) const uint64_t end,
+                __attribute__((unused)) const uint64_t nsummarymax,
+                __attribute__((unused)) const uint64_t nrow,
+                __attribute__((unused)) const uint64_t nsummary)
+    {
+      return true;
+    }
+  };
+};
+
+otc_event_source * otc_cache_source(const char * const filename,
+  void (* check_inputs)(const otc_cache & c, const char * const filename))
+{
+  return new cache_source(filename, check_inputs);
+}
+
+otc_event_source * otc_synth_source(const uint64_t nevent,
+                                    const uint64_t seed)
+{
+  return new synth_source(nevent, seed);
+}
+
+otc_event_sink * otc_colfile_sink(const char * const filename,
+                                  const bool clobber)
+{
+  return new colfile_sink(filename, clobber);
+}
+
+otc_event_sink * otc_null_sink()
+{
+  return new null_sink();
+}
@@ -0,0 +1,96 @@
+/**
+  \author Matthew Strait
+  \brief Where events come from and where the results go.
+
+  The event loop only sees these interfaces, so that muon.root files
+  are one kind of input among several and the ROOT output tree one kind
+  of output. The ROOT ones are made in otc_root.cpp; the rest are made
+  here and need neither ROOT nor ZOE.
+*/
+
+#ifndef OTC_IO_H
+#define OTC_IO_H
+
+#include <stdint.h>
+#include "otc_cont.h"
+#include "otc_arena.h"
+#include "otc_cache.h"
+
+/// Something that events can be read out of by event number
+class otc_event_source {
+  public:
+  virtual ~otc_event_source() {}
+
+  /// Number of events. They are numbered from zero.
+  virtual uint64_t nevent() const = 0;
+
+  /// Read up to nwanted events starting with event number 'first' into
+  /// b, using memory from arena if needed, and return how many were
+  /// read, which may be fewer if a file or block ends first, but is
+  /// never zero unless something is wrong. b is good until the arena is
+  /// reset or the source is deleted.
+  virtual unsigned int get_batch(otc_event_batch & b, const uint64_t first,
+                                 const unsigned int nwanted,
+                                 otc_arena & arena) = 0;
+
+  /// Number of bytes of input read so far, for reporting throughput
+  virtual uint64_t bytes_read() const = 0;
+};
+
+/// Something that the results for each event are written to
+class otc_event_sink {
+  public:
+  virtual ~otc_event_sink() {}
+
+  /// Called once before anything is written, with the range of event
+  /// numbers being processed and the most range summaries that can be
+  /// written.
+  virtual void begin(const uint64_t first, const uint64_t end,
+                     const uint64_t nsummary) = 0;
+
+  /// Write the results for one event. Events come in order.
+  virtual void write_event(const otc_output_event & out) = 0;
+
+  /// In sparse mode, write the summary of a range of events that were
+  /// not written out.
+  virtual void write_summary(const otc_range_summary & s) = 0;
+
+  /// Called once after everything is written
+  virtual void finish() = 0;
+
+  /// Make sure that everything written so far would survive otc being
+  /// killed, so that the output can be carried on with resume(). Only
+  /// called between events.
+  virtual void checkpoint() = 0;
+
+  /// Instead of begin(), with the same arguments as the run being
+  /// carried on, reopen the output of a run that was checkpointed
+  /// holding nrow events and nsummary summaries and carry on after
+  /// them. Returns false, with nothing left open, if the output doesn't
+  /// hold that as of its last checkpoint. Exits if it can't be opened.
+  virtual bool resume(const uint64_t first, const uint64_t end,
+                      const uint64_t nsummarymax, const uint64_t nrow,
+                      const uint64_t nsummary) = 0;
+};
+
+/// Read events from a cache file made with --build-cache. Exits if it
+/// can't be read. If check_inputs isn't null, it is given the opened
+/// cache to check the files it was made from, and may exit if they
+/// don't match.
+otc_event_source * otc_cache_source(const char * const filename,
+  void (* check_inputs)(const otc_cache & c, const char * const filename));
+
+/// Make nevent synthetic events from the given seed. Any event is the
+/// same no matter how the events are read. They use the channel
+/// numbers of otc_synth_geometry().
+otc_event_source * otc_synth_source(const uint64_t nevent,
+                                    const uint64_t seed);
+
+/// Write an otc_colfile. Unless 'clobber', exits if the file exists.
+otc_event_sink * otc_colfile_sink(const char * const filename,
+                                  const bool clobber);
+
+/// Throw the results away, for timing everything else
+otc_event_sink * otc_null_sink();
+
+#endif
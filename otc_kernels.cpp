@@ -0,0 +1,315 @@
+/**
+  \author Matthew Strait
+  \brief Vectorized loops over the hits of an event.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include "otc_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define OTC_HAVE_AVX2_KERNELS
+  #include <immintrin.h>
+#endif
+
+static const otc_stripgeom * farthest_strip_plain(const otc_event_view & hits,
+                                                  const unsigned int first)
+{
+  const otc_stripgeom * far = NULL;
+  double farthest = 0;
+
+  for(unsigned int i = first; i < hits.nhit; i++){
+    const otc_stripgeom & g =
+      otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], false));
+    if(g.r2 > farthest){
+      farthest = g.r2;
+      far = &g;
+    }
+
+    if(hits.Status[i] != 2){
+      const otc_stripgeom & g =
+        otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], true));
+      if(g.r2 > farthest){
+        farthest = g.r2;
+        far = &g;
+      }
+    }
+  }
+  return far;
+}
+
+// Doubles strictly between these truncate to something that fits in an
+// int
+static const double INTLOW = -2147483649.0, INTHIGH = 2147483648.0;
+
+static unsigned int doubles_to_ints_plain(int * const out,
+                                          const double * const in,
+                                          const unsigned int n)
+{
+  for(unsigned int i = 0; i < n; i++){
+    const double x = in[i];
+    if(!(x > INTLOW && x < INTHIGH)) return i;
+    out[i] = int(x);
+  }
+  return n;
+}
+
+static void count_hits_plain(otc_hitcounts & c, const otc_event_view & hits)
+{
+  memset(&c, 0, sizeof c);
+  for(unsigned int i = 0; i < hits.nhit; i++){
+    const otc_stripgeom & g =
+      otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], true));
+    if(!g.valid)     c.nbad++;
+    else if(g.upper) c.nhitup++;
+    else             c.nhitlo++;
+
+    if(i > 0 && hits.Time[i] < hits.Time[i-1]) c.nunordered++;
+  }
+}
+
+#ifdef OTC_HAVE_AVX2_KERNELS
+
+/* Sum of the eight lanes of v */
+__attribute__((target("avx2")))
+static unsigned int hsum(const __m256i v)
+{
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+/* Same as count_hits_plain(), eight hits at a time. The flags of each
+hit are gathered from otc_geomflags, and each count is kept per lane by
+subtracting the all-ones comparison results. */
+__attribute__((target("avx2")))
+static void count_hits_avx2(otc_hitcounts & c, const otc_event_view & hits)
+{
+  const unsigned int n = hits.nhit;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i lastch = _mm256_set1_epi32(OTC_MAXCHNUM - 1);
+  const __m256i edgeoffset = _mm256_set1_epi32(OTC_EDGELOW*OTC_MAXCHNUM);
+  const __m256i normal = _mm256_set1_epi32(2);
+  const __m256i validbit = _mm256_set1_epi32(OTC_GEOM_VALID);
+  const __m256i flagbits = _mm256_set1_epi32(OTC_GEOM_VALID|OTC_GEOM_UPPER);
+  const int * const flags = reinterpret_cast<const int *>(otc_geomflags);
+
+  __m256i up = zero, lo = zero, bad = zero, unordered = zero;
+
+  unsigned int i = 0;
+  for(; i + 8 <= n; i += 8){
+    const __m256i ch = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(hits.ChNum + i));
+    const __m256i status = _mm256_cvtepu16_epi32(_mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(hits.Status + i)));
+
+    // Channels past the end of the table are looked up as entry zero
+    // and then have their flags cleared. The comparison is unsigned.
+    const __m256i inrange =
+      _mm256_cmpeq_epi32(_mm256_min_epu32(ch, lastch), ch);
+    const __m256i isnormal = _mm256_cmpeq_epi32(status, normal);
+    const __m256i index = _mm256_and_si256(inrange,
+      _mm256_add_epi32(ch, _mm256_andnot_si256(isnormal, edgeoffset)));
+
+    const __m256i f = _mm256_and_si256(_mm256_and_si256(inrange, flagbits),
+      _mm256_i32gather_epi32(flags, index, 1));
+
+    up  = _mm256_sub_epi32(up,  _mm256_cmpeq_epi32(f, flagbits));
+    lo  = _mm256_sub_epi32(lo,  _mm256_cmpeq_epi32(f, validbit));
+    bad = _mm256_sub_epi32(bad, _mm256_cmpeq_epi32(f, zero));
+  }
+
+  unsigned int j = 1;
+  for(; j + 8 <= n; j += 8){
+    const __m256i t = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(hits.Time + j));
+    const __m256i before = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(hits.Time + j - 1));
+    unordered = _mm256_sub_epi32(unordered, _mm256_cmpgt_epi32(before, t));
+  }
+
+  c.nhitup = hsum(up);
+  c.nhitlo = hsum(lo);
+  c.nbad = hsum(bad);
+  c.nunordered = hsum(unordered);
+
+  // Whatever didn't fill a whole vector
+  for(; i < n; i++){
+    const otc_stripgeom & g =
+      otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], true));
+    if(!g.valid)     c.nbad++;
+    else if(g.upper) c.nhitup++;
+    else             c.nhitlo++;
+  }
+  for(; j < n; j++)
+    if(hits.Time[j] < hits.Time[j-1]) c.nunordered++;
+}
+
+/* Largest of the four lanes of v */
+__attribute__((target("avx2")))
+static double hmax(const __m256d v)
+{
+  __m128d m = _mm_max_pd(_mm256_castpd256_pd128(v),
+                         _mm256_extractf128_pd(v, 1));
+  m = _mm_max_sd(m, _mm_unpackhi_pd(m, m));
+  return _mm_cvtsd_f64(m);
+}
+
+/* Same as farthest_strip_plain(). First find the greatest r2 of any of
+the strips, four hits at a time, with the r2s gathered straight out of
+otc_geomtable. Then go back for the first strip that has it, which is
+usually found right away. */
+__attribute__((target("avx2")))
+static const otc_stripgeom * farthest_strip_avx2(const otc_event_view & hits,
+                                                 const unsigned int first)
+{
+  // Index of the r2 of table entry e, counting in doubles, is e*STRIDE
+  // plus R2OFFSET.
+  const int STRIDE = sizeof(otc_stripgeom)/sizeof(double);
+  const int R2OFFSET = offsetof(otc_stripgeom, r2)/sizeof(double);
+  const double * const table = reinterpret_cast<const double *>(otc_geomtable);
+
+  const __m128i lastch = _mm_set1_epi32(OTC_MAXCHNUM - 1);
+  const __m128i normal = _mm_set1_epi32(2);
+  const __m128i stride = _mm_set1_epi32(STRIDE);
+  const __m128i r2offset = _mm_set1_epi32(R2OFFSET);
+  const __m128i lowoffset = _mm_set1_epi32(OTC_EDGELOW*OTC_MAXCHNUM);
+  const __m128i highoffset = _mm_set1_epi32(OTC_EDGEHIGH*OTC_MAXCHNUM);
+  const __m256d zero = _mm256_setzero_pd();
+
+  __m256d best = zero;
+  unsigned int i = first;
+  for(; i + 4 <= hits.nhit; i += 4){
+    const __m128i ch = _mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(hits.ChNum + i));
+    const __m128i status = _mm_cvtepu16_epi32(_mm_loadl_epi64(
+      reinterpret_cast<const __m128i *>(hits.Status + i)));
+
+    // Out of range channels are bad channels, which are no distance
+    // from anything, so they are just not looked up. Unsigned compare.
+    const __m128i inrange = _mm_cmpeq_epi32(_mm_min_epu32(ch, lastch), ch);
+    const __m128i isnormal = _mm_cmpeq_epi32(status, normal);
+    const __m128i isedge = _mm_andnot_si128(isnormal, inrange);
+
+    const __m128i high = _mm_add_epi32(r2offset, _mm_mullo_epi32(stride,
+      _mm_add_epi32(ch, _mm_andnot_si128(isnormal, highoffset))));
+    const __m128i low = _mm_add_epi32(r2offset, _mm_mullo_epi32(stride,
+      _mm_add_epi32(ch, lowoffset)));
+
+    best = _mm256_max_pd(best, _mm256_mask_i32gather_pd(zero, table, high,
+      _mm256_castsi256_pd(_mm256_cvtepi32_epi64(inrange)), 8));
+    best = _mm256_max_pd(best, _mm256_mask_i32gather_pd(zero, table, low,
+      _mm256_castsi256_pd(_mm256_cvtepi32_epi64(isedge)), 8));
+  }
+
+  double farthest = hmax(best);
+  for(; i < hits.nhit; i++){
+    farthest = std::max(farthest,
+      otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], false)).r2);
+    if(hits.Status[i] != 2)
+      farthest = std::max(farthest,
+        otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], true)).r2);
+  }
+
+  if(!(farthest > 0)) return NULL;
+
+  for(i = first; i < hits.nhit; i++){
+    const otc_stripgeom & g =
+      otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], false));
+    if(g.r2 == farthest) return &g;
+
+    if(hits.Status[i] != 2){
+      const otc_stripgeom & g =
+        otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], true));
+      if(g.r2 == farthest) return &g;
+    }
+  }
+  return NULL; // not reached
+}
+
+/* Same as doubles_to_ints_plain(), eight at a time. All eight are
+loaded before any are stored, and the ints go no further than the
+doubles they came from, so converting in place is fine. */
+__attribute__((target("avx2")))
+static unsigned int doubles_to_ints_avx2(int * const out,
+                                         const double * const in,
+                                         const unsigned int n)
+{
+  const __m256d low = _mm256_set1_pd(INTLOW), high = _mm256_set1_pd(INTHIGH);
+
+  unsigned int i = 0;
+  for(; i + 8 <= n; i += 8){
+    const __m256d a = _mm256_loadu_pd(in + i);
+    const __m256d b = _mm256_loadu_pd(in + i + 4);
+
+    // Ordered comparisons, so that NaN counts as out of range
+    const __m256d ok = _mm256_and_pd(
+      _mm256_and_pd(_mm256_cmp_pd(a, low, _CMP_GT_OQ),
+                    _mm256_cmp_pd(a, high, _CMP_LT_OQ)),
+      _mm256_and_pd(_mm256_cmp_pd(b, low, _CMP_GT_OQ),
+                    _mm256_cmp_pd(b, high, _CMP_LT_OQ)));
+    if(_mm256_movemask_pd(ok) != 0xf) break;
+
+    const __m256i ints = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm256_cvttpd_epi32(a)),
+      _mm256_cvttpd_epi32(b), 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), ints);
+  }
+
+  // The rest, or the eight with a bad one somewhere in them
+  return i + doubles_to_ints_plain(out + i, in + i, n - i);
+}
+
+#endif
+
+namespace {
+  void (* count_hits_impl)(otc_hitcounts &, const otc_event_view &) =
+    count_hits_plain;
+  unsigned int (* doubles_to_ints_impl)(int * const, const double * const,
+    const unsigned int) = doubles_to_ints_plain;
+  const otc_stripgeom * (* farthest_strip_impl)(const otc_event_view &,
+    const unsigned int) = farthest_strip_plain;
+};
+
+void otc_kernels_init(const bool allowsimd)
+{
+  count_hits_impl = count_hits_plain;
+  doubles_to_ints_impl = doubles_to_ints_plain;
+  farthest_strip_impl = farthest_strip_plain;
+
+  #ifdef OTC_HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if(allowsimd && __builtin_cpu_supports("avx2")){
+      count_hits_impl = count_hits_avx2;
+      doubles_to_ints_impl = doubles_to_ints_avx2;
+      farthest_strip_impl = farthest_strip_avx2;
+    }
+  #else
+    (void)allowsimd;
+  #endif
+}
+
+bool otc_kernels_simd()
+{
+  return count_hits_impl != count_hits_plain;
+}
+
+void otc_count_hits(otc_hitcounts & c, const otc_event_view & hits)
+{
+  count_hits_impl(c, hits);
+}
+
+unsigned int otc_doubles_to_ints(int * const out, const double * const in,
+                                 const unsigned int n)
+{
+  return doubles_to_ints_impl(out, in, n);
+}
+
+const otc_stripgeom * otc_farthest_strip(const otc_event_view & hits,
+                                         const unsigned int first)
+{
+  return farthest_strip_impl(hits, first);
+}
@@ -0,0 +1,59 @@
+/**
+  \author Matthew Strait
+  \brief Vectorized loops over the hits of an event.
+
+  Each kernel has a plain version and, on x86, an AVX2 version. Which
+  one is used is decided once at startup, so the same binary runs on
+  any machine and uses AVX2 where there is one.
+*/
+
+#ifndef OTC_KERNELS_H
+#define OTC_KERNELS_H
+
+#include "otc_cont.h"
+#include "otc_geom.h"
+
+/// What otc_count_hits() finds out about an event's hits
+struct otc_hitcounts {
+  /// Hits in the upper and in the lower OV, as for otc_output_event
+  unsigned int nhitup, nhitlo;
+
+  /// Hits with channel numbers that aren't in the geometry table
+  unsigned int nbad;
+
+  /// Hits with an earlier time than the hit before
+  unsigned int nunordered;
+};
+
+/// Choose which version of each kernel to use. If 'allowsimd' is false,
+/// or the CPU can't do better, the plain versions are used. Must be
+/// called after the geometry table is filled and before any kernel.
+void otc_kernels_init(const bool allowsimd);
+
+/// Whether otc_kernels_init() chose the vector versions
+bool otc_kernels_simd();
+
+/// Count the hits of an event in the upper and lower OV, with edge
+/// triggers looked up as their lower strip, and count the hits with bad
+/// channel numbers or out of time order. The event must have ChNum,
+/// Status and Time.
+void otc_count_hits(otc_hitcounts & c, const otc_event_view & hits);
+
+/// Of hits 'first' through the last one, the strip farthest from the
+/// chimney, with edge triggers looked up as both their strips, higher
+/// first. If more than one is farthest, the first one wins. Returns
+/// null if none is any distance from the chimney. The event must have
+/// ChNum and Status.
+const otc_stripgeom * otc_farthest_strip(const otc_event_view & hits,
+                                         const unsigned int first);
+
+/// Convert in[0] through in[n-1] to ints, truncating, and put them in
+/// out. out may be the same memory as in, in which case the ints take
+/// up the first half of it. Stops at the first value that doesn't fit
+/// in an int, and returns the number converted, which is n if they all
+/// fit. After stopping at i, in[i] onward is still untouched, even if
+/// out is the same memory.
+unsigned int otc_doubles_to_ints(int * const out, const double * const in,
+                                 const unsigned int n);
+
+#endif
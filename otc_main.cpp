@@ -10,14 +10,28 @@ using namespace std;
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 #include <vector>
+#include <algorithm>
 #include "otc_cont.h"
+#include "otc_arena.h"
+#include "otc_geom.h"
+#include "otc_io.h"
 #include "otc_root.h"
+#include "otc_cache.h"
+#include "otc_synth.h"
+#include "otc_kernels.h"
+#include "otc_reco.h"
+#include "otc_timing.h"
+#include "otc_checkpoint.h"
+#include "otc_manifest.h"
+#include "otc_colfile.h"
 #include "otc_progress.cpp"
 
-#include "zcont.h"
-extern zdrawstrip ** striplinesabs;
-
 static void printhelp()
 {
   printf(
@@ -27,40 +41,256 @@ static void printhelp()
   "\n"
   "-c: Overwrite existing output file\n"
   "-n [number] Process at most this many events\n"
+  "--first [number] Start with this event number, counting from zero\n"
+  "--last [number] Stop after this event number\n"
+  "-j [number] Process events on this many threads\n"
+  "-z [number] Decompress input ahead of time on this many threads\n"
+  "--compress [alg[:level]] Compress output with zlib, lzma, lz4, zstd\n"
+  "                         or none. Default is zlib:9\n"
+  "--basket-size [bytes] Buffer size of each output branch\n"
+  "--bg-write: Fill and compress output on a background thread\n"
+  "--format [root|col|none] Write a ROOT file (the default), a columnar\n"
+  "                         file that can be memory-mapped, or nothing\n"
+  "--sparse: Only write out events with XY overlaps or errors, with\n"
+  "          their event numbers, and summarize the rest\n"
+  "--build-cache [file] Write the input events to this cache file and exit\n"
+  "--cache [file] Read events from this cache file instead of from\n"
+  "               muon.root files\n"
+  "--synth [number] Make up this many events instead of reading any.\n"
+  "                 Unless -g is given, they use a made-up geometry\n"
+  "--no-simd: Don't use vector instructions even if the CPU has them\n"
+  "--timing: Time each stage of processing and report at the end\n"
+  "--perf: Like --timing, and also count cycles, cache misses and\n"
+  "        branch mispredictions in each stage\n"
+  "--metrics [dest] Write progress as JSON lines to this file, or to a\n"
+  "                 Unix socket if given as unix:[path]\n"
+  "--metrics-period [seconds] How often to write metrics. Default is 10\n"
+  "--checkpoint [seconds] This often, make the output safe to carry on\n"
+  "                       with --resume if otc is stopped or killed\n"
+  "--resume: Carry on a run made with --checkpoint. Give the same options\n"
+  "          and files as before\n"
+  "--watch [dir] Keep running, and process each muon.root file that is\n"
+  "              written to or moved into this directory from now on.\n"
+  "              Each gets its own output in the directory given with -o\n"
+  "--manifest [file] Process each input file into a part of its own and\n"
+  "                  put the parts together into the output. Files that\n"
+  "                  haven't changed since the last time with the same\n"
+  "                  manifest aren't processed again\n"
+  "-g [file] Read channel geometry from this file instead of from ZOE\n"
+  "-G [file] Write channel geometry from ZOE to this file and exit\n"
   "-h: This help text\n");
 }
 
+// Everything that can be set from the command line
+struct otc_options {
+  bool clobber; // Whether to overwrite existing output
+  unsigned int maxevent; // Most events to process, or zero for no limit
+  char * outfile;
+
+  // Range of event numbers to process, inclusive. If !lastgiven, go to
+  // the end.
+  uint64_t first, last;
+  bool lastgiven;
+
+  int nthread, nunzip;
+  char * geomin, * geomout;
+
+  // Output file settings. Null/zero for the defaults.
+  char * compression;
+  int basketsize;
+  bool bgwrite;
+
+  // One of the FORMAT_ values
+  int format;
+
+  // Only write events with XY overlaps or errors
+  bool sparse;
+
+  // Cache file to write, or to read events from
+  char * buildcache, * cache;
+
+  // If nonzero, make up this many events instead of reading any
+  uint64_t synth;
+
+  bool nosimd;
+
+  // Time each stage, and count hardware events if 'perf'
+  bool timing, perf;
+
+  // Where to write metrics, or null, and how often
+  char * metrics;
+  int metricsperiod;
+
+  // Seconds between checkpoints, or zero for none, and whether to carry
+  // on a checkpointed run
+  int checkpoint;
+  bool resume;
+
+  // Directory to watch for new muon.root files, or null
+  char * watch;
+
+  // Record of which input files have been processed, or null
+  char * manifest;
+};
+
+// Values returned by getopt_long() for options with no short form
+enum { OPT_FIRST = 256, OPT_LAST, OPT_COMPRESS, OPT_BASKETSIZE,
+       OPT_BGWRITE, OPT_FORMAT, OPT_SPARSE, OPT_BUILDCACHE, OPT_CACHE,
+       OPT_NOSIMD, OPT_SYNTH, OPT_TIMING, OPT_PERF,
+       OPT_METRICS, OPT_METRICSPERIOD, OPT_CHECKPOINT, OPT_RESUME,
+       OPT_WATCH, OPT_MANIFEST };
+
+// Kinds of output
+enum { FORMAT_ROOT, FORMAT_COL, FORMAT_NONE };
+
+// Seconds between checkpoints if --resume is given without --checkpoint
+static const int DEFAULT_CHECKPOINT = 600;
+
+/* Parse arg, given with option opt, as a number between min and max. */
+static uint64_t parse_number(const char * const arg, const char * const opt,
+                             const uint64_t min, const uint64_t max)
+{
+  errno = 0;
+  char * endptr;
+  const unsigned long long n = strtoull(arg, &endptr, 10);
+  if(errno != 0 || endptr == arg || *endptr != '\0' || arg[0] == '-' ||
+     n < min || n > max){
+    fprintf(stderr, "%s (given with %s) isn't a number I can handle\n",
+            arg, opt);
+    exit(1);
+  }
+  return n;
+}
+
 /** Parses the command line and returns the position of the first file
 name (i.e. the first argument not parsed). */
-static int handle_cmdline(int argc, char ** argv, bool & clobber,
-                          unsigned int & nevents, char * & outfile)
+static int handle_cmdline(int argc, char ** argv, otc_options & o)
 {
-  const char * const opts = "o:chn:";
+  const char * const opts = "o:chn:j:z:g:G:";
+  const struct option longopts[] = {
+    { "first", required_argument, NULL, OPT_FIRST },
+    { "last",  required_argument, NULL, OPT_LAST  },
+    { "compress",    required_argument, NULL, OPT_COMPRESS   },
+    { "basket-size", required_argument, NULL, OPT_BASKETSIZE },
+    { "bg-write",    no_argument,       NULL, OPT_BGWRITE    },
+    { "format",      required_argument, NULL, OPT_FORMAT     },
+    { "sparse",      no_argument,       NULL, OPT_SPARSE     },
+    { "build-cache", required_argument, NULL, OPT_BUILDCACHE },
+    { "cache",       required_argument, NULL, OPT_CACHE      },
+    { "no-simd",     no_argument,       NULL, OPT_NOSIMD     },
+    { "synth",       required_argument, NULL, OPT_SYNTH      },
+    { "timing",      no_argument,       NULL, OPT_TIMING     },
+    { "perf",        no_argument,       NULL, OPT_PERF       },
+    { "metrics",     required_argument, NULL, OPT_METRICS    },
+    { "metrics-period", required_argument, NULL, OPT_METRICSPERIOD },
+    { "checkpoint",  required_argument, NULL, OPT_CHECKPOINT },
+    { "resume",      no_argument,       NULL, OPT_RESUME     },
+    { "watch",       required_argument, NULL, OPT_WATCH      },
+    { "manifest",    required_argument, NULL, OPT_MANIFEST   },
+    { NULL, 0, NULL, 0 }
+  };
   bool done = false;
  
   while(!done){
-    char whatwegot;
-    switch(whatwegot = getopt(argc, argv, opts)){
+    int whatwegot;
+    switch(whatwegot = getopt_long(argc, argv, opts, longopts, NULL)){
       case -1:
         done = true;
         break;
       case 'n':
         errno = 0;
         char * endptr;
-        nevents = strtol(optarg, &endptr, 10);
-        if((errno == ERANGE && (nevents == UINT_MAX)) || 
-           (errno != 0 && nevents == 0) || 
+        o.maxevent = strtol(optarg, &endptr, 10);
+        if((errno == ERANGE && (o.maxevent == UINT_MAX)) || 
+           (errno != 0 && o.maxevent == 0) || 
            endptr == optarg || *endptr != '\0'){
           fprintf(stderr,
             "%s (given with -n) isn't a number I can handle\n", optarg);
           exit(1);
         }
         break;
+      case OPT_FIRST:
+        o.first = parse_number(optarg, "--first", 0, UINT_MAX);
+        break;
+      case OPT_LAST:
+        o.last = parse_number(optarg, "--last", 0, UINT_MAX);
+        o.lastgiven = true;
+        break;
+      case OPT_COMPRESS:
+        o.compression = optarg;
+        break;
+      case OPT_BASKETSIZE:
+        o.basketsize = parse_number(optarg, "--basket-size", 1024, 1 << 30);
+        break;
+      case OPT_BGWRITE:
+        o.bgwrite = true;
+        break;
+      case OPT_FORMAT:
+        if(!strcmp(optarg, "root"))      o.format = FORMAT_ROOT;
+        else if(!strcmp(optarg, "col"))  o.format = FORMAT_COL;
+        else if(!strcmp(optarg, "none")) o.format = FORMAT_NONE;
+        else{
+          fprintf(stderr, "--format must be root, col or none, not %s\n",
+                  optarg);
+          exit(1);
+        }
+        break;
+      case OPT_SPARSE:
+        o.sparse = true;
+        break;
+      case OPT_BUILDCACHE:
+        o.buildcache = optarg;
+        break;
+      case OPT_CACHE:
+        o.cache = optarg;
+        break;
+      case OPT_NOSIMD:
+        o.nosimd = true;
+        break;
+      case OPT_SYNTH:
+        o.synth = parse_number(optarg, "--synth", 1, UINT_MAX);
+        break;
+      case OPT_TIMING:
+        o.timing = true;
+        break;
+      case OPT_PERF:
+        o.timing = o.perf = true;
+        break;
+      case OPT_METRICS:
+        o.metrics = optarg;
+        break;
+      case OPT_METRICSPERIOD:
+        o.metricsperiod = parse_number(optarg, "--metrics-period", 1, 86400);
+        break;
+      case OPT_CHECKPOINT:
+        o.checkpoint = parse_number(optarg, "--checkpoint", 1, 86400*7);
+        break;
+      case OPT_RESUME:
+        o.resume = true;
+        break;
+      case OPT_WATCH:
+        o.watch = optarg;
+        break;
+      case OPT_MANIFEST:
+        o.manifest = optarg;
+        break;
+      case 'j':
+        o.nthread = parse_number(optarg, "-j", 1, 1024);
+        break;
+      case 'z':
+        o.nunzip = parse_number(optarg, "-z", 0, 1024);
+        break;
       case 'o':
-        outfile = optarg;
+        o.outfile = optarg;
+        break;
+      case 'g':
+        o.geomin = optarg;
+        break;
+      case 'G':
+        o.geomout = optarg;
         break;
       case 'c':
-        clobber = true;
+        o.clobber = true;
         break;
       case 'h':
         printhelp();
@@ -71,12 +301,92 @@ static int handle_cmdline(int argc, char ** argv, bool & clobber,
     }
   }  
 
-  if(!outfile){
+  // Writing the geometry is a job in itself
+  if(o.geomout) return optind;
+
+  if(o.buildcache && o.cache){
+    fprintf(stderr, "Can't both build a cache and read from one\n");
+    exit(1);
+  }
+
+  if(o.resume && !o.checkpoint) o.checkpoint = DEFAULT_CHECKPOINT;
+
+  if(o.checkpoint && o.buildcache){
+    fprintf(stderr, "Building a cache can't be checkpointed\n");
+    exit(1);
+  }
+
+  if(o.checkpoint && !o.outfile){
+    fprintf(stderr, "--checkpoint and --resume need an output file given "
+            "with -o\n");
+    exit(1);
+  }
+
+  if(o.cache && o.synth){
+    fprintf(stderr, "Can't both read a cache and make up events\n");
+    exit(1);
+  }
+
+  if(!o.outfile && !o.buildcache && o.format != FORMAT_NONE){
     fprintf(stderr, "You must give an output file name with -o\n");
     printhelp();
     exit(1);
   }
 
+  if(o.lastgiven && o.last < o.first){
+    fprintf(stderr, "--last must not be before --first\n");
+    exit(1);
+  }
+
+  if(o.manifest){
+    if(o.cache || o.synth || o.buildcache || o.checkpoint || o.watch){
+      fprintf(stderr, "--manifest can't be used with --cache, --synth, "
+              "--build-cache, --checkpoint, --resume or --watch\n");
+      exit(1);
+    }
+    if(o.first || o.lastgiven || o.maxevent){
+      fprintf(stderr, "--manifest can't be used with --first, --last or "
+              "-n\n");
+      exit(1);
+    }
+    if(!o.outfile){
+      fprintf(stderr, "--manifest needs an output file given with -o\n");
+      exit(1);
+    }
+  }
+
+  if(o.watch){
+    if(o.cache || o.synth || o.buildcache || o.checkpoint){
+      fprintf(stderr, "--watch can't be used with --cache, --synth, "
+              "--build-cache, --checkpoint or --resume\n");
+      exit(1);
+    }
+    if(o.first || o.lastgiven || o.maxevent){
+      fprintf(stderr, "--watch can't be used with --first, --last or -n\n");
+      exit(1);
+    }
+    struct stat st;
+    if(o.outfile && (stat(o.outfile, &st) || !S_ISDIR(st.st_mode))){
+      fprintf(stderr, "With --watch, -o must name a directory for the "
+              "output files\n");
+      exit(1);
+    }
+    if(argc > optind){
+      fprintf(stderr, "Give either --watch or muon.root files, not both\n");
+      exit(1);
+    }
+    return optind;
+  }
+
+  if(o.cache || o.synth){
+    if(argc > optind){
+      fprintf(stderr, "Give either %s or muon.root files, not both\n",
+              o.cache? "a cache": "--synth");
+      exit(1);
+    }
+    return optind;
+  }
+
   if(argc <= optind){
     fprintf(stderr, "Please give at least one muon.root file.\n\n");
     printhelp();
@@ -85,9 +395,24 @@ static int handle_cmdline(int argc, char ** argv, bool & clobber,
   return optind;
 }
 
+namespace {
+  // With checkpointing, the name of the checkpoint file, which is null
+  // otherwise
+  char * ckname = NULL;
+
+  // Whether we are watching a directory for new files
+  bool watching = false;
+
+  // Set when a signal asks us to stop at the next checkpoint
+  volatile sig_atomic_t stopasked = 0;
+};
+
 static void on_segv_or_bus(const int signal)
 {
   fprintf(stderr, "Got %s. Exiting.\n", signal==SIGSEGV? "SEGV": "BUS");
+  if(ckname)
+    fprintf(stderr, "The output as of the last checkpoint can be carried "
+            "on with --resume.\n");
   // Use _exit() instead of exit() to avoid calling atexit() functions
   // and/or other signal handlers. Something, presumably in the bowels
   // of ROOT, must be doing one of these since a call to exit() can take
@@ -96,154 +421,880 @@ static void on_segv_or_bus(const int signal)
 }
 
 /** To be called when the user presses Ctrl-C or something similar
-happens. */
+happens. With checkpointing, stop at the next batch of events with a
+checkpoint, and when watching a directory, stop after the current file,
+unless asked twice. */
 static void endearly(__attribute__((unused)) int signal)
 {
+  if((ckname || watching) && !stopasked){
+    stopasked = 1;
+    fprintf(stderr, "Got Ctrl-C or similar.  Stopping %s.\n",
+            ckname? "at a checkpoint": "after the current file");
+    return;
+  }
   fprintf(stderr, "Got Ctrl-C or similar.  Exiting.\n");
   _exit(1); // See comment above
 }
 
-static cart3 makecart3(const double x, const double y, const double z)
+// Number of events read at once when not using worker threads. Big
+// enough that reading a branch at a time pays off, small enough that the
+// columns stay in cache until they are used.
+static const unsigned int SERIAL_BATCH = 256;
+
+// Number of events handed to the worker threads at once, per thread.
+// Enough to keep everyone busy through the unevenness of event sizes.
+static const unsigned int EVENTS_PER_WORKER = 16;
+
+// One event on its way through the worker threads
+struct evslot {
+  otc_event_view in;
+  bool readok;
+  otc_output_event out;
+  bool syncpulse; // only for counting them
+
+  // Whether there are hits to complain about, which is done as events
+  // are written out so that it comes out in order
+  bool badhits;
+};
+
+// A set of consecutive events given to the worker threads. Since slot i
+// holds event first+i, the results can be written out in order no
+// matter in what order the workers finish them.
+struct evbatch {
+  evslot * slots;
+  otc_arena arena;    // where the slots' hits are
+  unsigned int first; // event number of slots[0]
+  unsigned int n;     // number of slots in use
+  unsigned int next;  // next slot for a worker to claim
+  unsigned int ndone; // number of slots finished
+};
+
+namespace {
+  pthread_mutex_t poolmutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t workready = PTHREAD_COND_INITIALIZER;
+  pthread_cond_t workdone = PTHREAD_COND_INITIALIZER;
+
+  // The batch most recently given to the workers, and a count of how
+  // many have been given, so they can tell whether it is new.
+  evbatch * curbatch = NULL;
+  unsigned int batchgen = 0;
+  bool poolquit = false;
+
+  // How far along we are, which the workers add to
+  progress prog;
+};
+
+/* Compute the results for slot i of b */
+static void compute_slot(evbatch & b, const unsigned int i)
 {
-  cart3 a;
-  a.x = x;
-  a.y = y;
-  a.z = z;
-  return a;
+  const uint64_t start = otc_timing_now();
+  b.slots[i].out = doit(b.slots[i].in, b.slots[i].readok,
+                        b.slots[i].badhits);
+  b.slots[i].syncpulse = is_sync_pulse(b.slots[i].in);
+  otc_timing_sample(OTC_STAGE_COMPUTE, b.first + i, 1,
+                    otc_timing_now() - start);
 }
 
-static cart3 stpcenter(const unsigned int ch,
-                       const unsigned short status,
-                       const bool uselowiftrig)
+/* arg points to the number of this worker, from zero */
+static void * worker(void * arg)
 {
-  // If this is not an ADC hit, assume it is a trigger box hit (it is)
-  // Just using zhit for geometry, don't bother setting adc/tick/index
-  const zhit hit(ch, 0, 0, status == 2? normal:
-                       uselowiftrig?edgelow:edgehigh, 0);
-  const zdrawstrip strip = striplinesabs[hit.mod][hit.stp];
-  return makecart3((strip.x1+strip.x2)/2,
-                   (strip.y1+strip.y2)/2,
-                   strip.z);
+  const int me = *static_cast<int *>(arg);
+  unsigned int seengen = 0;
+  while(true){
+    pthread_mutex_lock(&poolmutex);
+    while(!poolquit && batchgen == seengen)
+      pthread_cond_wait(&workready, &poolmutex);
+    if(poolquit){
+      pthread_mutex_unlock(&poolmutex);
+      return NULL;
+    }
+    seengen = batchgen;
+    evbatch * const b = curbatch;
+    pthread_mutex_unlock(&poolmutex);
+
+    unsigned int i, finished = 0;
+    otc_timing_counters_begin();
+    while((i = __sync_fetch_and_add(&b->next, 1)) < b->n){
+      compute_slot(*b, i);
+      finished++;
+    }
+    otc_timing_counters_end(OTC_STAGE_COMPUTE);
+    progress_worker(prog, me, finished);
+
+    pthread_mutex_lock(&poolmutex);
+    b->ndone += finished;
+    if(b->ndone == b->n) pthread_cond_signal(&workdone);
+    pthread_mutex_unlock(&poolmutex);
+  }
+}
+
+static void post_batch(evbatch & b)
+{
+  pthread_mutex_lock(&poolmutex);
+  b.next = b.ndone = 0;
+  curbatch = &b;
+  batchgen++;
+  pthread_cond_broadcast(&workready);
+  pthread_mutex_unlock(&poolmutex);
 }
 
-static void lastpos(otc_output_event & __restrict__ out,
-                    const OVEventForReco & __restrict__ hits)
+static void wait_batch(evbatch & b)
+{
+  pthread_mutex_lock(&poolmutex);
+  while(b.ndone != b.n) pthread_cond_wait(&workdone, &poolmutex);
+  pthread_mutex_unlock(&poolmutex);
+}
+
+namespace {
+  // Where events come from and where the results go
+  otc_event_source * source = NULL;
+  otc_event_sink * sink = NULL;
+};
+
+/* Read up to batchsize events starting with 'first', and not including
+'end' or after, into b. */
+static void fill_batch(evbatch & b, const unsigned int first,
+                       const unsigned int end,
+                       const unsigned int batchsize)
 {
-  double farthest = 0;
-
-  unsigned int i = 0;
-  while(hits.Time[i] != hits.Time[hits.nhit-1]) i++;
-
-  for(; i < hits.nhit; i++){
-    const cart3 sc = stpcenter(hits.ChNum[i], hits.Status[i], false);
-    const double dist = sqrt(sc.x*sc.x + sc.y*sc.y);
-    if(dist > farthest){
-      farthest = dist;
-      out.lastx = int(sc.x);
-      out.lasty = int(sc.y);
-      out.lastz = int(sc.z);
+  b.first = first;
+  b.n = first >= end? 0: end - first < batchsize? end - first: batchsize;
+  otc_arena_reset(b.arena);
+  for(unsigned int got = 0; got < b.n; ){
+    otc_event_batch eb;
+    const unsigned int n = source->get_batch(eb, first+got, b.n-got, b.arena);
+    if(n == 0){
+      fprintf(stderr, "Could not read any events starting at %u\n", first+got);
+      exit(1);
     }
+    for(unsigned int i = 0; i < n; i++){
+      otc_batch_event(b.slots[got+i].in, eb, i);
+      b.slots[got+i].readok = eb.readok[i];
+    }
+    got += n;
+  }
+  progress_bytes(prog, source->bytes_read());
+}
 
-    if(hits.Status[i] != 2){
-      const cart3 sc = stpcenter(hits.ChNum[i], hits.Status[i], true);
-      const double dist = sqrt(sc.x*sc.x + sc.y*sc.y);
-      if(dist > farthest){
-        farthest = dist;
-        out.lastx = int(sc.x);
-        out.lasty = int(sc.y);
-        out.lastz = int(sc.z);
-      }
+// In sparse mode, events that aren't written out are summarized in
+// ranges of this many, starting at multiples of it.
+static const uint64_t SUMMARY_RANGE = 1000;
+
+namespace {
+  // In sparse mode, the range of events being processed and the
+  // summary of the range of them that is being worked through
+  bool sparse = false;
+  uint64_t outfirst = 0, outend = 0;
+  otc_range_summary summary;
+
+  // Number of events and summaries given to the sink
+  uint64_t nrow = 0, nsummarywritten = 0;
+};
+
+/* Number of summary ranges that events first up to end touch */
+static uint64_t summary_ranges(const uint64_t first, const uint64_t end)
+{
+  return end <= first? 0: (end-1)/SUMMARY_RANGE - first/SUMMARY_RANGE + 1;
+}
+
+/* Write out the current summary if it has anything in it */
+static void flush_summary()
+{
+  if(!summary.nevent) return;
+  sink->write_summary(summary);
+  nsummarywritten++;
+  summary.nevent = 0;
+}
+
+/* Write out the results for event evn. In sparse mode, events with
+neither XY overlaps nor errors only go into the summary of their
+range. */
+static void output_event(const uint64_t evn, const bool hasxy,
+                         const otc_output_event & out)
+{
+  if(sparse && !hasxy && !out.error){
+    if(evn >= summary.end){
+      flush_summary();
+      memset(&summary, 0, sizeof summary);
+      const uint64_t rangefirst = evn - evn%SUMMARY_RANGE;
+      summary.first = max(rangefirst, outfirst);
+      summary.end = min(rangefirst + SUMMARY_RANGE, outend);
     }
+    summary.nevent++;
+    summary.sumnhitup += out.nhitup;
+    summary.sumnhitlo += out.nhitlo;
+    summary.maxnhitup = max(summary.maxnhitup, uint32_t(out.nhitup));
+    summary.maxnhitlo = max(summary.maxnhitlo, uint32_t(out.nhitlo));
+    return;
   }
+
+  otc_output_event row = out;
+  row.event = evn;
+  sink->write_event(row);
+  nrow++;
+}
+
+namespace {
+  // With checkpointing, seconds between checkpoints, when the last one
+  // was made and what the checkpoint file says
+  int ckperiod = 0;
+  double lastcktime = 0;
+  otc_checkpoint ck;
+};
+
+/* Make the output safe as of having written everything before event
+'next', and record that in the checkpoint file. */
+static void make_checkpoint(const uint64_t next)
+{
+  const uint64_t start = otc_timing_begin();
+
+  ck.pending.next = next;
+  ck.pending.nrow = nrow;
+  ck.pending.nsummary = nsummarywritten;
+  ck.pending.summary = summary;
+  ck.haspending = true;
+  otc_checkpoint_write(ckname, ck);
+
+  sink->checkpoint();
+
+  ck.done = ck.pending;
+  ck.haspending = false;
+  otc_checkpoint_write(ckname, ck);
+
+  lastcktime = now_seconds();
+  otc_timing_end(OTC_STAGE_FILL, 0, 0, start);
 }
 
-/* See comments for is_sync_pulse() in
-DOGS/DCReco/DCOVNuMerger/DCOVNuMerger.cc */
-static bool is_sync_pulse(const OVEventForReco & hits)
+/* Having written everything before event 'next', make a checkpoint if
+it's time to or a signal asked us to stop, and then stop if asked. */
+static void maybe_checkpoint(const uint64_t next)
 {
-  // Must have some number of trigger boxes each throwing 32 hits
-  if(hits.nhit == 0 || hits.nhit%32 != 0) return false;
+  if(!ckname) return;
+  if(!stopasked && now_seconds() - lastcktime < ckperiod) return;
 
-  for(unsigned int i = 0; i < hits.nhit; i++){
-    // Must not have any ordinary hits
-    if(hits.Status[i] == 2) return false;
+  make_checkpoint(next);
+  if(stopasked){
+    printf("Stopped before event %lu. Run again with --resume to finish.\n",
+           (unsigned long)next);
+    fflush(stdout);
+    _exit(1); // See comment in on_segv_or_bus()
+  }
+}
 
-    const int first_tb_channel = 20000;
+/* Reopen the output of a checkpointed run and return the first event
+that it doesn't have yet. */
+static uint64_t resume_output(const char * const outfile,
+                              const uint64_t nsummarymax)
+{
+  otc_checkpoint_read(ckname, ck);
 
-    // Must have a hit in the highest invalid channel
-    if((hits.ChNum[i]-first_tb_channel)%100 == 31) return true; 
+  // If the last checkpoint was cut off, the output might hold either
+  // what it did before or what it would have after
+  const otc_checkpoint_state * s = NULL;
+  if(sink->resume(ck.first, ck.end, nsummarymax, ck.done.nrow,
+                  ck.done.nsummary))
+    s = &ck.done;
+  else if(ck.haspending &&
+          sink->resume(ck.first, ck.end, nsummarymax, ck.pending.nrow,
+                       ck.pending.nsummary))
+    s = &ck.pending;
+  else{
+    fprintf(stderr, "%s doesn't hold what %s says it did at the last "
+            "checkpoint, so the run can't be carried on\n", outfile, ckname);
+    exit(1);
   }
 
-  // In the extraordinary case that there are a multiple of 32 hits, all
-  // of them are from trigger boxes, but none are in invalid channels,
-  // this must be a highly improbable real event with many edge strip
-  // triggers.
-  return false;
+  nrow = s->nrow;
+  nsummarywritten = s->nsummary;
+  summary = s->summary;
+  ck.done = *s;
+  ck.haspending = false;
+
+  printf("Resuming at event %lu\n", (unsigned long)s->next);
+  return s->next;
+}
+
+/* Write out the results for b */
+static void write_batch(const evbatch & b)
+{
+  uint64_t nerror = 0, nsync = 0, nnoxy = 0;
+  otc_timing_counters_begin();
+  for(unsigned int i = 0; i < b.n; i++){
+    const unsigned int evn = b.first + i;
+    if(b.slots[i].badhits) report_bad_hits(b.slots[i].in);
+    if(b.slots[i].out.error) printf("error event number: %d\n", evn);
+    nerror += b.slots[i].out.error;
+    nsync += b.slots[i].syncpulse;
+    nnoxy += !b.slots[i].in.nxy;
+    const uint64_t start = otc_timing_now();
+    output_event(evn, !!b.slots[i].in.nxy, b.slots[i].out);
+    otc_timing_sample(OTC_STAGE_FILL, evn, 1, otc_timing_now() - start);
+  }
+  otc_timing_counters_end(OTC_STAGE_FILL);
+  progress_kinds(prog, nerror, nsync, nnoxy);
+  progress_done(prog, b.n);
 }
 
-static void do_hits_stuff(otc_output_event & __restrict__ out,
-                          const OVEventForReco & __restrict__ hits,
-                          const bool hasxy)
+/* Like the serial loop in doit_loop(), but with doit() run on nthread
+worker threads. This thread reads the next batch of events while the
+workers process the current one, then writes out the current one in
+order. Reading and writing stay on this thread since ROOT I/O is not
+thread-safe. */
+static void doit_loop_threaded(const unsigned int first,
+                               const unsigned int end, const int nthread)
 {
-  // Should not happen for data, but can happen in Monte Carlo
-  if(hits.nhit == 0) return;
+  const unsigned int batchsize = nthread*EVENTS_PER_WORKER;
 
-  if(is_sync_pulse(hits)) return;
- 
-  for(unsigned int i = 0; i < hits.nhit; i++){
-    // Just using zhit for geometry, don't bother setting adc/tick/index
-    const zhit hit(hits.ChNum[i], 0, 0,
-                   hits.Status[i] == 2? normal: edgelow, 0);
-
-    // ZOE will return mod = stp = 0 for bad channel numbers
-    // It will also print a message, we we don't have to.
-    if(hit.mod == 0){       out.error = true;
-      printf("nhit = %d\n", hits.nhit);
+  // Left over from the last time, if we're processing file after file
+  curbatch = NULL;
+  batchgen = 0;
+  poolquit = false;
+
+  evbatch batches[2];
+  for(int i = 0; i < 2; i++) batches[i].slots = new evslot[batchsize];
+
+  vector<pthread_t> threads(nthread);
+  vector<int> ids(nthread);
+  for(int i = 0; i < nthread; i++){
+    ids[i] = i;
+    if(pthread_create(&threads[i], NULL, worker, &ids[i])){
+      fprintf(stderr, "Could not start worker thread %d\n", i);
+      exit(1);
     }
-    else if(hit.mod > 135) out.nhitup++;
-    else                   out.nhitlo++;
+  }
+
+  int cur = 0;
+  fill_batch(batches[cur], first, end, batchsize);
+  post_batch(batches[cur]);
+
+  while(batches[cur].n){
+    evbatch & other = batches[!cur];
+    fill_batch(other, batches[cur].first + batches[cur].n, end, batchsize);
+    wait_batch(batches[cur]);
+    write_batch(batches[cur]);
+    maybe_checkpoint(batches[cur].first + batches[cur].n);
+    if(other.n) post_batch(other);
+    cur = !cur;
+  }
+
+  pthread_mutex_lock(&poolmutex);
+  poolquit = true;
+  pthread_cond_broadcast(&workready);
+  pthread_mutex_unlock(&poolmutex);
+  for(int i = 0; i < nthread; i++) pthread_join(threads[i], NULL);
+
+  for(int i = 0; i < 2; i++) delete[] batches[i].slots;
+}
+
+/* Process events 'first' up to, but not including, 'end'. */
+static void doit_loop(const unsigned int first, const unsigned int end,
+                      const int nthread)
+{
+  printf("Working...\n");
+  startprogress(prog, end - first, 4, nthread, "OTC");
 
-    if(i > 0 && hits.Time[i] < hits.Time[i-1]){
-      printf("Hits %d and %d of %d out of order with times %d and %d\n",
-             i, i-1, hits.nhit, hits.Time[i-1], hits.Time[i]);
-      out.error = true;
+  if(nthread > 1){
+    doit_loop_threaded(first, end, nthread);
+  }
+  else{
+    evbatch b;
+    b.slots = new evslot[SERIAL_BATCH];
+    for(unsigned int i = first; i < end; i += b.n){
+      fill_batch(b, i, end, SERIAL_BATCH);
+      otc_timing_counters_begin();
+      for(unsigned int j = 0; j < b.n; j++) compute_slot(b, j);
+      otc_timing_counters_end(OTC_STAGE_COMPUTE);
+      progress_worker(prog, 0, b.n);
+      write_batch(b);
+      maybe_checkpoint(b.first + b.n);
     }
+    delete[] b.slots;
   }
 
-  // For variables other than nhit{lo,up}, no one is interested in
-  // events without XY overlaps and it saves oodles of disk space not to
-  // store the answers for events without.
-  if(!hasxy) return;
+  finishprogress(prog);
+  printf("All done working.\n");
+}
 
-  out.length = hits.Time[hits.nhit-1] - hits.Time[0] + 1;
+/* Modification time of a file in nanoseconds */
+static uint64_t mtime_ns(const struct stat & st)
+{
+  return st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec;
+}
 
-  if(!out.error) lastpos(out, hits);
+/* Exit if any of the muon.root files that cache c, named cachename, was
+made from has changed since. Files that are gone can't be checked, and
+may well have been moved away since there is a cache of them. */
+static void check_cache_inputs(const otc_cache & c,
+                               const char * const cachename)
+{
+  for(uint64_t i = 0; i < c.header->ninput; i++){
+    const otc_cache_input & in = c.inputs[i];
+    const char * const name = c.inputnames + in.nameoffset;
+    struct stat st;
+    if(stat(name, &st)){
+      fprintf(stderr, "%s, which %s was made from, is gone, so can't be "
+              "checked\n", name, cachename);
+      continue;
+    }
+
+    // As with --manifest, only open the file if it looks different
+    if((uint64_t)st.st_size == in.size && mtime_ns(st) == in.mtime) continue;
+    if((uint64_t)st.st_size != in.size ||
+       otc_root_header_hash(name) != in.hash){
+      fprintf(stderr, "%s has changed since %s was made from it. Build the "
+              "cache again.\n", name, cachename);
+      exit(1);
+    }
+  }
 }
 
-static otc_output_event doit(const otc_input_event & inevent)
+/* Open wherever the events come from, reading only the given input
+columns if there's a choice. */
+static otc_event_source * open_source(const otc_options & o,
+                                      const char * const * const infiles,
+                                      const int nfiles,
+                                      const unsigned int columns)
 {
-  otc_output_event out;
-  memset(&out, 0, sizeof(out));
-  
-  do_hits_stuff(out, inevent.hits, !!inevent.nxy);
+  if(o.cache) return otc_cache_source(o.cache, check_cache_inputs);
+  if(o.synth) return otc_synth_source(o.synth, 1);
+  return otc_root_source(infiles, nfiles, o.nunzip, columns);
+}
 
-  return out;
+/* Open wherever the results go. Output being resumed is expected to be
+there already. */
+static otc_event_sink * open_sink(const otc_options & o)
+{
+  const bool clobber = o.clobber || o.resume;
+  switch(o.format){
+    case FORMAT_COL:  return otc_colfile_sink(o.outfile, clobber);
+    case FORMAT_NONE: return otc_null_sink();
+    default:
+      if(o.compression) set_output_compression(o.compression);
+      set_output_basket_size(o.basketsize);
+      set_output_background(o.bgwrite);
+      set_output_sparse(o.sparse);
+      return otc_root_sink(clobber, o.outfile);
+  }
 }
 
-static void doit_loop(const unsigned int nevent)
+// Events per block of a cache file. Reads from a cache never cross
+// blocks, so this should be much bigger than any batch.
+static const unsigned int CACHE_BLOCK = 1 << 14;
+
+/* Read all the events from the source, which is the given muon.root
+files unless they are made up, and write them to a cache file. */
+static void build_cache(const otc_options & o, char ** const infiles,
+                        const int nfiles)
 {
-  printf("Working...\n");
-  initprogressindicator(nevent, 4);
+  const uint64_t nevent = source->nevent();
+
+  otc_cache_writer w;
+  otc_cache_create(w, o.buildcache, o.clobber);
 
-  // NOTE: Do not attempt to start anywhere but on event zero.
-  // For better performance, we don't allow random seeks.
-  for(unsigned int i = 0; i < nevent; i++){
-    otc_output_event out = doit(get_event(i));
-    if(out.error) printf("error event number: %d\n", i);
-    write_event(out);
-    progressindicator(i, "OTC");
+  // So that the cache won't be used if they change. They are recorded
+  // by their full paths, since the cache may be used from elsewhere.
+  for(int i = 0; i < nfiles && !o.synth; i++){
+    char path[PATH_MAX];
+    struct stat st;
+    if(!realpath(infiles[i], path) || stat(path, &st)){
+      fprintf(stderr, "Could not read %s: %s\n", infiles[i], strerror(errno));
+      exit(1);
+    }
+    otc_cache_input in = otc_cache_input();
+    in.size = st.st_size;
+    in.mtime = mtime_ns(st);
+    in.hash = otc_root_header_hash(path);
+    otc_cache_add_input(w, path, in);
   }
-  printf("All done working.\n");
+
+  printf("Writing cache...\n");
+  startprogress(prog, nevent, 4, 1, "Cache");
+
+  otc_event_batch b;
+  otc_arena arena;
+  for(uint64_t i = 0; i < nevent; ){
+    otc_arena_reset(arena);
+    const unsigned int n = source->get_batch(b, i,
+      nevent - i < CACHE_BLOCK? nevent - i: CACHE_BLOCK, arena);
+    if(n == 0){
+      fprintf(stderr, "Could not read any events starting at %lu\n",
+              (unsigned long)i);
+      exit(1);
+    }
+    otc_cache_write_batch(w, b);
+    i += n;
+    progress_bytes(prog, source->bytes_read());
+    progress_done(prog, n);
+  }
+  finishprogress(prog);
+
+  otc_cache_finish(w);
+  printf("Wrote %lu events to %s\n", (unsigned long)nevent, o.buildcache);
+}
+
+/* Process the events from the given muon.root files, or whatever else
+the options say to read, and write the output. Returns the number of
+events read from. With --watch, input that can't be read is skipped
+instead of stopping us. */
+static uint64_t process(const otc_options & o, char ** const infiles,
+                        const int nfiles)
+{
+  // Open the output first so that we find out right away if it is in
+  // the way, not after reading through all the input files.
+  sink = open_sink(o);
+  if(o.checkpoint){
+    const size_t len = strlen(o.outfile) + sizeof ".checkpoint";
+    ckname = new char[len];
+    snprintf(ckname, len, "%s.checkpoint", o.outfile);
+    ckperiod = o.checkpoint;
+  }
+  source = open_source(o, infiles, nfiles, needed_columns());
+
+  // A file that is damaged or still being copied shouldn't stop --watch
+  if(!source){
+    if(!o.watch) _exit(1);
+    printf("Skipping %s, which could not be read\n", infiles[0]);
+    delete sink;
+    return 0;
+  }
+
+  const uint64_t nevent = source->nevent();
+
+  // A new file that is empty isn't worth stopping for
+  if(nevent == 0 && o.watch){
+    printf("No events to process\n");
+    delete sink;
+    delete source;
+    return 0;
+  }
+
+  // An empty file still gets its part, which is empty
+  if(o.first >= nevent && !(nevent == 0 && o.manifest)){
+    fprintf(stderr, "Asked to start at event %lu, but there are only %lu\n",
+            (unsigned long)o.first, (unsigned long)nevent);
+    exit(1);
+  }
+
+  uint64_t end = o.lastgiven && o.last < nevent? o.last + 1: nevent;
+  if(o.maxevent && end - o.first > o.maxevent) end = o.first + o.maxevent;
+
+  if(o.first != 0 || end != nevent)
+    printf("Processing events %lu through %lu of %lu\n",
+           (unsigned long)o.first, (unsigned long)end - 1,
+           (unsigned long)nevent);
+
+  sparse = o.sparse;
+  outfirst = o.first;
+  outend = end;
+  nrow = nsummarywritten = 0;
+  memset(&summary, 0, sizeof summary);
+
+  const uint64_t nsummarymax = sparse? summary_ranges(o.first, end): 0;
+  uint64_t start = o.first;
+
+  // What is read from, so that a run can't be resumed on other input
+  char synthdesc[64];
+  snprintf(synthdesc, sizeof synthdesc, "synth:%lu", (unsigned long)o.synth);
+  const char * const onlyinput = o.cache? o.cache: synthdesc;
+
+  if(ckname){
+    if(o.cache || o.synth){
+      ck.inputs = &onlyinput;
+      ck.ninput = 1;
+    }
+    else{
+      ck.inputs = infiles;
+      ck.ninput = nfiles;
+    }
+    ck.first = o.first;
+    ck.end = end;
+    ck.sparse = sparse;
+  }
+
+  if(o.resume){
+    start = resume_output(o.outfile, nsummarymax);
+  }
+  else{
+    sink->begin(o.first, end, nsummarymax);
+    if(ckname) make_checkpoint(o.first);
+  }
+
+  if(start < end) doit_loop(start, end, o.nthread);
+
+  // Writing out whatever the sink has held back counts as filling,
+  // but not for any event in particular
+  const uint64_t finishstart = otc_timing_begin();
+  flush_summary();
+  sink->finish();
+  otc_timing_end(OTC_STAGE_FILL, 0, 0, finishstart);
+  delete sink;
+  delete source;
+
+  // The output is whole, so there's nothing left to carry on
+  if(ckname) unlink(ckname);
+
+  return nevent;
+}
+
+// Change this whenever otc comes to write something different for any
+// event, so that parts made before aren't used.
+static const uint32_t OUTPUT_VERSION = 1;
+
+/* Put the parts of the given entries of m together, in order, into the
+output sink 'out', with event numbers counting from the start of the
+first. */
+static void stitch(const otc_options & o, otc_event_sink * const out,
+                   const otc_manifest & m, const vector<unsigned int> & used)
+{
+  // Parts are opened one at a time, since there may be thousands
+  uint64_t nevent = 0, nsummary = 0;
+  for(unsigned int i = 0; i < used.size(); i++){
+    const otc_manifest_entry & e = m.entries[used[i]];
+    otc_colfile f;
+    otc_colfile_open(f, e.part);
+    if(o.sparse? f.header->nevent > e.nevent: f.header->nevent != e.nevent){
+      fprintf(stderr, "%s doesn't have the events that %s says it does. "
+              "Remove it and it will be made again.\n", e.part, o.manifest);
+      exit(1);
+    }
+    nevent += e.nevent;
+    nsummary += f.header->nsummary;
+    otc_colfile_close(f);
+  }
+
+  sink = out;
+  sink->begin(0, nevent, nsummary);
+
+  printf("Putting %u parts together...\n", (unsigned int)used.size());
+  if(nevent) startprogress(prog, nevent, 4, 1, "Stitch");
+
+  uint64_t offset = 0;
+  for(unsigned int i = 0; i < used.size(); i++){
+    const otc_manifest_entry & e = m.entries[used[i]];
+    otc_colfile f;
+    otc_colfile_open(f, e.part);
+
+    for(uint64_t j = 0; j < f.header->nevent; j++){
+      otc_output_event out;
+      memset(&out, 0, sizeof out);
+      out.length = f.length[j];
+      out.lastx = f.lastx[j];
+      out.lasty = f.lasty[j];
+      out.lastz = f.lastz[j];
+      out.error = f.error[j];
+      out.nhitup = f.nhitup[j];
+      out.nhitlo = f.nhitlo[j];
+      out.event = f.event[j] + offset;
+      sink->write_event(out);
+    }
+
+    for(uint64_t j = 0; j < f.header->nsummary; j++){
+      otc_range_summary s = f.summary[j];
+      s.first += offset;
+      s.end += offset;
+      sink->write_summary(s);
+    }
+
+    otc_colfile_close(f);
+    offset += e.nevent;
+    if(nevent) progress_done(prog, e.nevent);
+  }
+
+  if(nevent) finishprogress(prog);
+  sink->finish();
+  delete sink;
+}
+
+/* With --manifest, process each input file that is new or has changed
+since the manifest was last written into its own part, and then put all
+of the parts together into the output. In sparse mode, the summary
+ranges of each part stop at the end of its file. */
+static void process_manifest(const otc_options & o, char ** const infiles,
+                             const int nfiles)
+{
+  // Find out now if the output is in the way, not after processing
+  // every file
+  otc_event_sink * const out = open_sink(o);
+
+  otc_manifest m;
+  otc_manifest_read(o.manifest, m);
+
+  // Everything besides the input that the parts depend on
+  uint64_t settings =
+    otc_hash(&OUTPUT_VERSION, sizeof OUTPUT_VERSION, OTC_HASH_INIT);
+  settings = otc_hash(&o.sparse, sizeof o.sparse, settings);
+  settings = otc_hash(otc_geomtable, sizeof otc_geomtable, settings);
+  if(!m.entries.empty() && m.settings != settings){
+    printf("The geometry or settings are different from when %s was "
+           "written, so every file will be processed again\n", o.manifest);
+    m.entries.clear();
+  }
+  m.settings = settings;
+
+  char partdir[PATH_MAX];
+  snprintf(partdir, sizeof partdir, "%s.parts", o.outfile);
+  if(mkdir(partdir, 0777) && errno != EEXIST){
+    fprintf(stderr, "Could not make %s: %s\n", partdir, strerror(errno));
+    exit(1);
+  }
+
+  vector<unsigned int> used;
+  int nunchanged = 0;
+  for(int i = 0; i < nfiles; i++){
+    struct stat st;
+    if(stat(infiles[i], &st)){
+      fprintf(stderr, "Could not read %s: %s\n", infiles[i], strerror(errno));
+      exit(1);
+    }
+    const uint64_t size = st.st_size, mtime = mtime_ns(st);
+
+    otc_manifest_entry * e = otc_manifest_find(m, infiles[i]);
+    const bool haspart = e && access(e->part, R_OK) == 0;
+
+    // The file is only opened to hash its trees' headers if its size
+    // and time don't already say it is unchanged, so that a run in
+    // which nothing changed doesn't open every file
+    const bool sametime = haspart && e->size == size && e->mtime == mtime;
+    const uint64_t hash =
+      sametime? e->hash: otc_root_header_hash(infiles[i]);
+
+    if(haspart && e->size == size && e->hash == hash){
+      // If only the time is different, it was touched or copied
+      e->mtime = mtime;
+      nunchanged++;
+    }
+    else{
+      if(!e){
+        if(strlen(infiles[i]) >= sizeof e->input){
+          fprintf(stderr, "File name %s is too long\n", infiles[i]);
+          exit(1);
+        }
+        m.entries.push_back(otc_manifest_entry());
+        e = &m.entries.back();
+        strcpy(e->input, infiles[i]);
+      }
+      e->size = size;
+      e->mtime = mtime;
+      e->hash = hash;
+
+      char oldpart[PATH_MAX];
+      strcpy(oldpart, e->part);
+
+      // Named after what is in the input
+      if(snprintf(e->part, sizeof e->part, "%s/%016lx.col", partdir,
+                  (unsigned long)otc_hash(&size, sizeof size, hash))
+         >= (int)sizeof e->part){
+        fprintf(stderr, "Output file name %s is too long\n", o.outfile);
+        exit(1);
+      }
+
+      printf("Processing %s\n", infiles[i]);
+      otc_options po = o;
+      po.format = FORMAT_COL;
+      po.outfile = e->part;
+      po.clobber = true;
+      e->nevent = process(po, infiles + i, 1);
+
+      // So that if we are stopped, what is done so far is kept
+      otc_manifest_write(o.manifest, m);
+
+      // The part from before this file changed is no good now, unless
+      // another file happens to be what this one was
+      if(oldpart[0] && strcmp(oldpart, e->part)){
+        bool shared = false;
+        for(unsigned int j = 0; j < m.entries.size(); j++)
+          shared |= !strcmp(m.entries[j].part, oldpart);
+        if(!shared) unlink(oldpart);
+      }
+    }
+    used.push_back(e - &m.entries[0]);
+  }
+
+  printf("%d of %d files were unchanged and not processed again\n",
+         nunchanged, nfiles);
+  otc_manifest_write(o.manifest, m);
+  stitch(o, out, m, used);
+}
+
+/* In watch mode, process a new file called 'name' in the watched
+directory, unless its output is already there. */
+static void process_watched(const otc_options & o, const char * const name)
+{
+  char infile[PATH_MAX], outfile[PATH_MAX];
+  snprintf(infile, sizeof infile, "%s/%s", o.watch, name);
+
+  // Named after the input, with .root replaced by .otc.root or .otc.col
+  otc_options fo = o;
+  if(o.format != FORMAT_NONE){
+    snprintf(outfile, sizeof outfile, "%s/%.*s.otc.%s", o.outfile,
+             int(strlen(name) - 5), name,
+             o.format == FORMAT_COL? "col": "root");
+    if(!o.clobber && access(outfile, F_OK) == 0){
+      printf("Skipping %s since %s already exists\n", infile, outfile);
+      return;
+    }
+    fo.outfile = outfile;
+  }
+
+  printf("Processing %s\n", infile);
+  char * files[] = { infile };
+  process(fo, files, 1);
+  fflush(stdout);
+}
+
+/* Whether name is one of our own ROOT outputs, which match *muon*.root
+too, and which we write into the watched directory if -o names it */
+static bool is_otc_output(const char * const name)
+{
+  const size_t len = strlen(name);
+  return len >= 9 && !strcmp(name + len - 9, ".otc.root");
+}
+
+/* Process each muon.root file that is written to or moved into the
+directory given with --watch from now on, until a signal asks us to
+stop. The geometry, kernels and everything else already set up are
+kept from one file to the next. */
+static void watch_dir(const otc_options & o)
+{
+  const int fd = inotify_init1(IN_CLOEXEC);
+  if(fd < 0 ||
+     inotify_add_watch(fd, o.watch, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+    fprintf(stderr, "Could not watch %s: %s\n", o.watch, strerror(errno));
+    exit(1);
+  }
+  watching = true;
+  printf("Watching %s for new muon.root files\n", o.watch);
+  fflush(stdout);
+
+  // Room for a good number of events at once, aligned as they need
+  char buf[64*(sizeof(inotify_event) + NAME_MAX + 1)]
+    __attribute__((aligned(__alignof__(inotify_event))));
+
+  while(!stopasked){
+    // Unlike read(), poll() is always interrupted by a signal, so this
+    // is where we find out we've been asked to stop
+    pollfd p = { fd, POLLIN, 0 };
+    if(poll(&p, 1, -1) <= 0) continue;
+
+    const ssize_t len = read(fd, buf, sizeof buf);
+    if(len < 0){
+      if(errno == EINTR) continue;
+      fprintf(stderr, "Could not watch %s: %s\n", o.watch, strerror(errno));
+      exit(1);
+    }
+
+    for(char * at = buf; at < buf + len && !stopasked; ){
+      const inotify_event * const e = reinterpret_cast<inotify_event *>(at);
+      at += sizeof *e + e->len;
+      if(e->mask & IN_Q_OVERFLOW)
+        fprintf(stderr, "Too many files arrived at once. Some were missed.\n");
+      if(e->len && !otc_root_bad_name(e->name) && !is_otc_output(e->name))
+        process_watched(o, e->name);
+    }
+  }
+
+  close(fd);
+  printf("Stopped watching %s\n", o.watch);
 }
 
 int main(int argc, char ** argv)
@@ -254,18 +1305,43 @@ int main(int argc, char ** argv)
   signal(SIGHUP,  endearly);
   signal(SIGPIPE, endearly);
 
-  char * outfile = NULL;
-  bool clobber = false; // Whether to overwrite existing output
-                         
-  unsigned int maxevent = 0;
-  const int file1 = handle_cmdline(argc,argv,clobber,maxevent,outfile);
+  otc_options o;
+  memset(&o, 0, sizeof o);
+  o.nthread = 1;
+  o.metricsperiod = 10;
+  const int file1 = handle_cmdline(argc, argv, o);
+
+  if(o.metrics) progress_metrics(prog, o.metrics, o.metricsperiod);
+
+  // Caching doesn't need the geometry, so do it before that
+  if(o.buildcache){
+    source = open_source(o, argv + file1, argc - file1, OTC_COL_ALL);
+    build_cache(o, argv + file1, argc - file1);
+    delete source;
+    return 0;
+  }
+
+  // Everything that depends on the detector geometry is looked up in a
+  // table from here on, which also makes it safe to use from the
+  // worker threads.
+  if(o.geomin)     otc_geom_load(o.geomin);
+  else if(o.synth) otc_synth_geometry();
+  else             otc_geom_from_zoe();
+
+  if(o.geomout){
+    otc_geom_save(o.geomout);
+    printf("Wrote geometry to %s\n", o.geomout);
+    return 0;
+  }
 
-  const unsigned int nevent = root_init(maxevent, clobber, outfile, 
-                                        argv + file1, argc - file1);
+  otc_kernels_init(!o.nosimd);
+  if(o.timing) otc_timing_init(o.perf);
 
-  doit_loop(nevent);
+  if(o.watch)         watch_dir(o);
+  else if(o.manifest) process_manifest(o, argv + file1, argc - file1);
+  else                process(o, argv + file1, argc - file1);
 
-  root_finish();
+  otc_timing_report();
   
   return 0;
 }
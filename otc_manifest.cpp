@@ -0,0 +1,121 @@
+/**
+  \author Matthew Strait
+  \brief What has already been made from which input files.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "otc_manifest.h"
+
+static const char MANIFESTMAGIC[] = "otc manifest 1";
+
+uint64_t otc_hash(const void * const data, const size_t n, uint64_t h)
+{
+  const unsigned char * const p = static_cast<const unsigned char *>(data);
+  for(size_t i = 0; i < n; i++){
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void otc_manifest_read(const char * const filename, otc_manifest & m)
+{
+  m.settings = 0;
+  m.entries.clear();
+
+  FILE * const f = fopen(filename, "r");
+  if(!f){
+    if(errno == ENOENT) return;
+    fprintf(stderr, "Could not open manifest %s: %s\n", filename,
+            strerror(errno));
+    exit(1);
+  }
+
+  // Lines are "file", the numbers, the part and the input, separated by
+  // tabs, since file names are more likely to have spaces in them
+  char line[2*PATH_MAX + 128];
+  unsigned long settings;
+  bool bad = !fgets(line, sizeof line, f) ||
+             strncmp(line, MANIFESTMAGIC, sizeof MANIFESTMAGIC - 1) ||
+             !fgets(line, sizeof line, f) ||
+             sscanf(line, "settings %lx", &settings) != 1;
+  m.settings = settings;
+
+  while(!bad && fgets(line, sizeof line, f)){
+    line[strcspn(line, "\n")] = '\0';
+
+    otc_manifest_entry e;
+    unsigned long size, mtime, hash, nevent;
+    int n = 0;
+    if(sscanf(line, "file\t%lu\t%lu\t%lx\t%lu\t%n", &size, &mtime, &hash,
+              &nevent, &n) != 4 || !n){
+      bad = true;
+      break;
+    }
+
+    char * const partname = line + n;
+    char * const tab = strchr(partname, '\t');
+    if(!tab || strlen(partname) >= sizeof e.part ||
+       strlen(tab + 1) >= sizeof e.input || !tab[1]){
+      bad = true;
+      break;
+    }
+    *tab = '\0';
+    strcpy(e.part, partname);
+    strcpy(e.input, tab + 1);
+    e.size = size;
+    e.mtime = mtime;
+    e.hash = hash;
+    e.nevent = nevent;
+    m.entries.push_back(e);
+  }
+  fclose(f);
+
+  if(bad){
+    fprintf(stderr, "%s is not an otc manifest, or is damaged\n", filename);
+    exit(1);
+  }
+}
+
+void otc_manifest_write(const char * const filename, const otc_manifest & m)
+{
+  // As with checkpoint files, written beside the old one and renamed
+  // over it so that there is always a whole one
+  char tmpname[PATH_MAX];
+  snprintf(tmpname, sizeof tmpname, "%s.tmp", filename);
+
+  FILE * const f = fopen(tmpname, "w");
+  if(!f){
+    fprintf(stderr, "Could not open %s to write manifest: %s\n", tmpname,
+            strerror(errno));
+    exit(1);
+  }
+
+  fprintf(f, "%s\nsettings %016lx\n", MANIFESTMAGIC,
+          (unsigned long)m.settings);
+  for(unsigned int i = 0; i < m.entries.size(); i++){
+    const otc_manifest_entry & e = m.entries[i];
+    fprintf(f, "file\t%lu\t%lu\t%016lx\t%lu\t%s\t%s\n", (unsigned long)e.size,
+            (unsigned long)e.mtime, (unsigned long)e.hash,
+            (unsigned long)e.nevent, e.part, e.input);
+  }
+
+  const bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if(fclose(f) || !ok || rename(tmpname, filename)){
+    fprintf(stderr, "Failed writing manifest %s: %s\n", filename,
+            strerror(errno));
+    exit(1);
+  }
+}
+
+otc_manifest_entry * otc_manifest_find(otc_manifest & m,
+                                       const char * const input)
+{
+  for(unsigned int i = 0; i < m.entries.size(); i++)
+    if(!strcmp(m.entries[i].input, input)) return &m.entries[i];
+  return NULL;
+}
@@ -0,0 +1,65 @@
+/**
+  \author Matthew Strait
+  \brief What has already been made from which input files.
+
+  With --manifest, each input file is processed into its own part, a
+  columnar file named after what is in the input, and the parts are
+  then put together into the output. The manifest says, for each input
+  file, what it was like when it was processed (its size, modification
+  time and a hash of its trees' headers) and where its part is, so that
+  a rerun only processes the files that are new or have changed.
+
+  It is plain text, one line per input file.
+*/
+
+#ifndef OTC_MANIFEST_H
+#define OTC_MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <vector>
+
+/// Where to start a hash from
+const uint64_t OTC_HASH_INIT = 14695981039346656037ULL;
+
+/// Add n bytes of data to hash h, which starts as OTC_HASH_INIT. This
+/// is FNV-1a, which is plenty to tell whether something has changed,
+/// but not meant to stand up to anyone trying to fool it.
+uint64_t otc_hash(const void * const data, const size_t n, uint64_t h);
+
+/// One input file and its part
+struct otc_manifest_entry {
+  /// As given on the command line
+  char input[PATH_MAX];
+
+  /// What it was like when it was processed. mtime is in nanoseconds.
+  uint64_t size, mtime, hash;
+
+  /// Number of events in it
+  uint64_t nevent;
+
+  char part[PATH_MAX];
+};
+
+struct otc_manifest {
+  /// A hash of everything besides the input that the parts depend on,
+  /// like the geometry. If it changes, none of the parts are any good.
+  uint64_t settings;
+
+  std::vector<otc_manifest_entry> entries;
+};
+
+/// Read a manifest. If the file doesn't exist, m is left empty. Exits
+/// if it can't be read.
+void otc_manifest_read(const char * const filename, otc_manifest & m);
+
+/// Write m to filename, replacing what was there in one step. Exits on
+/// failure.
+void otc_manifest_write(const char * const filename, const otc_manifest & m);
+
+/// The entry for the given input file, or null if there isn't one
+otc_manifest_entry * otc_manifest_find(otc_manifest & m,
+                                       const char * const input);
+
+#endif
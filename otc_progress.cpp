@@ -2,6 +2,12 @@
 #include <math.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <vector>
 using std::vector;
 #include <algorithm>
@@ -319,16 +325,13 @@ static int etasec(const double ince, const double tote,
                     (  N - (2*N-1)*frac)*tote)   );
 }
 
-// Returns a string describing the estimated time left. Returns a
-// pointer to a string representing the time to be printed. Caller must
-// free the string when done with it.
-static char * eta(int & dispeta, const double ince, const double tote, 
-                  const double frac)
+// Puts a string describing the estimated time left in answer, which
+// must be CHARMAX long.
+static void eta(char * answer, int & dispeta, const double ince,
+                const double tote, const double frac)
 {
-  char * answer = (char*)malloc(CHARMAX);
   dispeta = formatestimate(answer, etasec(ince, tote, frac), false, 
                  frac < 0.1 ? 1 : 2); 
-  return answer;
 }
 
 // Give a total time so far and the estimated time to completion,
@@ -364,53 +367,45 @@ static int sfofetot(const int eta, const int tot)
 // isn't a typical occurance (usually things get better or worse
 // abruptly when other jobs seize or release resources, or you run out
 // of buffer space, or whatnot), so I'm not going to protect against it.
-static bool nopreviousestimate = true; 
-static int findstatus(int dispeta, double inctime)
+//
+// previousprint is the ETA of the last report, or -1 if there hasn't
+// been one.
+static int findstatus(int & previousprint, int dispeta, double inctime)
 {
-  static int previousprint;
-
   int status;
 
-  if(nopreviousestimate) status = 0;
+  if(previousprint < 0) status = 0;
   else if(dispeta < 2) status = 0;
   else if(dispeta+inctime < 0.75*previousprint) status = 1;
   else if(dispeta+inctime > 1.33*previousprint) status = -1;
   else status = 0;
 
   previousprint = dispeta;
-  nopreviousestimate = false;
 
   return status;
 }
 
-// Returns a string describing the estimated total running time. Returns
-// a pointer to a string representing the time to be printed. Caller
-// must free the string when done with it. 
-static char * etotal(const double tottime, const double ince,
-                     const double tote, const double frac)
+// Puts a string describing the estimated total running time in answer,
+// which must be CHARMAX long.
+static void etotal(char * answer, const double tottime, const double ince,
+                   const double tote, const double frac)
 {
-  char * answer = (char*)malloc(CHARMAX);
-
   int eta = etasec(ince, tote, frac); // estimate
   int tot = int(tottime); // exact
   int current = eta + tot;
 
   formatestimate(answer, current, true, sfofetot(eta, tot)); 
-
-  return answer;
 }
 
-// Returns a pointer to a string representing the time to be printed.
-// Caller must free the string when done with it.
-static char * disptime(const double ttime)
+// Puts a string representing the time to be printed in buf, which must
+// be CHARMAX long.
+static void disptime(char * buf, const double ttime)
 {
-  char * buf = (char*)malloc(CHARMAX);
-
   if(ttime >= 2.147483648e9){
     fprintf(stderr, "I'm not going to be able to store %f in an int!\n",
             ttime);
     snprintf(buf, CHARMAX, "more than 78 years");
-    return buf;
+    return;
   }
 
   int t = int(ttime);
@@ -440,8 +435,6 @@ static char * disptime(const double ttime)
 
   if(showseconds)
     snprintf(buf+printed, CHARMAX-printed, "%0*ds", reqzero?2:1, t);
-
-  return buf;
 } 
 
 
@@ -503,31 +496,141 @@ vector<unsigned int> generateprintpoints(const unsigned int total,
   return ppoints;
 }
 
-// Each time, new is set to the current time. old is set to the current
-// time the first time, then subsequently is set to new at the bottom
-static double firsttime, oldtime;
-static vector<unsigned int> ppoints; // the values of sofar to print
-static unsigned int nextprint = 0xffffffff;
-static double lastfrac;
-static unsigned int total;
+// One worker thread's count of events it has finished, on a cache line
+// of its own so that the workers don't slow each other down counting.
+struct workercount {
+  uint64_t n;
+  char pad[64 - sizeof(uint64_t)];
+};
+
+// The progress of one task. Any number of threads can add to the counts
+// at the top with the progress_ functions, while a reporter thread
+// looks at them now and then and prints how it's going.
+struct progress {
+  // The number of events completely finished, the number of bytes of
+  // input read, and the number of events each worker has done
+  uint64_t done, bytes;
+  vector<workercount> workers;
+
+  // Of the finished events, how many had errors, were sync pulses and
+  // had no XY overlaps
+  uint64_t nerror, nsync, nnoxy;
+
+  unsigned int total;
+  const char * taskname;
+
+  // Everything from here down belongs to the reporter thread
+  pthread_t reporter;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  bool stop;
+
+  // Each time, new is set to the current time. old is set to the
+  // current time the first time, then subsequently is set to new at
+  // the bottom. The same goes for the counts as of the last report.
+  double firsttime, oldtime;
+  vector<unsigned int> ppoints; // the values of sofar to print
+  double lastfrac;
+  uint64_t lastdone, lastbytes;
+  vector<uint64_t> lastworkers;
+  int previousprint; // ETA of the last report, or -1 if none
+
+  // Where to write metrics, if 'metrics', how many seconds apart, and
+  // the time and counts as of the last time they were written. These
+  // are set by progress_metrics() and outlast any one task.
+  bool metrics, metricssocket;
+  int metricsfd;
+  double metricsperiod;
+  double metricstime;
+  uint64_t metricsdone;
+};
+
+// How often, in milliseconds, the reporter thread looks at the counts
+static const int REPORTER_PERIOD_MS = 250;
+
+static uint64_t progress_load(const uint64_t & n)
+{
+  return __atomic_load_n(&n, __ATOMIC_RELAXED);
+}
+
+/* Record that n more events are completely finished */
+static inline void progress_done(progress & p, const uint64_t n)
+{
+  __atomic_fetch_add(&p.done, n, __ATOMIC_RELAXED);
+}
 
-static void printprogress(const unsigned int sofar,
-                          const char * const taskname)
+/* Record that worker w has finished n more events */
+static inline void progress_worker(progress & p, const int w,
+                                   const uint64_t n)
 {
-  // we're never going to find this one or any one before it again,
-  // so remove them to save time in future searches.
-  if(ppoints.size()){
-    ppoints.erase(ppoints.begin());
-    nextprint = ppoints[0];
-  }
+  __atomic_fetch_add(&p.workers[w].n, n, __ATOMIC_RELAXED);
+}
 
-  double frac = double(sofar)/total;
+/* Record that, of the events just finished, nerror had errors, nsync
+were sync pulses and nnoxy had no XY overlaps */
+static inline void progress_kinds(progress & p, const uint64_t nerror,
+                                  const uint64_t nsync, const uint64_t nnoxy)
+{
+  __atomic_fetch_add(&p.nerror, nerror, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p.nsync, nsync, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p.nnoxy, nnoxy, __ATOMIC_RELAXED);
+}
+
+/* Record that 'bytes' bytes of input have been read in all */
+static inline void progress_bytes(progress & p, const uint64_t bytes)
+{
+  __atomic_store_n(&p.bytes, bytes, __ATOMIC_RELAXED);
+}
 
+static double now_seconds()
+{
   struct timeval brokennewtime;
   gettimeofday(&brokennewtime, NULL); 
-  double newtime = brokennewtime.tv_sec + 1e-6 * brokennewtime.tv_usec;
-  double tottime = newtime - firsttime;
-  double inctime = newtime - oldtime;
+  return brokennewtime.tv_sec + 1e-6 * brokennewtime.tv_usec;
+}
+
+/* Put the rates since the last report, or over the whole task if this
+is the last one, in buf, which must be CHARMAX long. */
+static void disprates(char * buf, progress & p, const bool last,
+                      const double tottime, const double inctime)
+{
+  const uint64_t done = progress_load(p.done),
+                 bytes = progress_load(p.bytes);
+  const double span = last? tottime: inctime;
+  const double evps = (done - (last? 0: p.lastdone))/span;
+  const double mbps = (bytes - (last? 0: p.lastbytes))/span/1e6;
+  int printed = snprintf(buf, CHARMAX, "%9.0f ev/s %7.1f MB/s", evps, mbps);
+
+  // How much more the busiest worker did than the average, which is 1
+  // if the work is spread evenly
+  if(p.workers.size() > 1){
+    uint64_t sum = 0, most = 0;
+    for(unsigned int i = 0; i < p.workers.size(); i++){
+      const uint64_t n = progress_load(p.workers[i].n);
+      const uint64_t did = n - (last? 0: p.lastworkers[i]);
+      sum += did;
+      if(did > most) most = did;
+      p.lastworkers[i] = n;
+    }
+    if(sum)
+      snprintf(buf+printed, CHARMAX-printed, " skew %4.2f",
+               double(most)*p.workers.size()/sum);
+  }
+
+  p.lastdone = done;
+  p.lastbytes = bytes;
+}
+
+static void printprogress(progress & p, const unsigned int sofar)
+{
+  const unsigned int total = p.total;
+  const char * const taskname = p.taskname;
+
+  double frac = double(sofar)/total;
+
+  double newtime = now_seconds();
+  double tottime = newtime - p.firsttime;
+  double inctime = newtime - p.oldtime;
 
   // Don't print anything until N seconds have passed since the first
   // time since often programs do their first few iterations slowly due
@@ -542,10 +645,10 @@ static void printprogress(const unsigned int sofar,
   // else before starting the loop AND does the first call with 0.
   // frac-lastfrac can happen if the user improperly calls us with the
   // same number twice.
-  if(frac == 0 || frac-lastfrac == 0) return;
+  if(frac == 0 || frac-p.lastfrac == 0) return;
 
   double tote = tottime/frac - tottime;
-  double ince = frac-lastfrac > 0? (1-frac)*inctime/(frac-lastfrac): -1;
+  double ince = frac-p.lastfrac > 0? (1-frac)*inctime/(frac-p.lastfrac): -1;
 
   int ep;
   // Force last call to be 100%, not 99.98% or something silly like that
@@ -561,12 +664,15 @@ static void printprogress(const unsigned int sofar,
   else if(frac < 0.099        || frac > 0.9)        ep = 1;
   else                                              ep = 0;
 
-  char * dispelapsed = disptime(tottime);
+  char dispelapsed[CHARMAX], dispeta[CHARMAX], disptot[CHARMAX];
+  char disprate[CHARMAX];
+  disptime(dispelapsed, tottime);
   int ndispeta;
-  char * dispeta = eta(ndispeta, ince, tote, frac);
-  int status = findstatus(ndispeta, inctime);
-  char * disptot = etotal(tottime, ince, tote, frac);
+  eta(dispeta, ndispeta, ince, tote, frac);
+  int status = findstatus(p.previousprint, ndispeta, inctime);
+  etotal(disptot, tottime, ince, tote, frac);
   if(sofar == total - 1) disptot[0] = '\0';
+  disprates(disprate, p, sofar == total - 1, tottime, inctime);
 
   // If your background wasn't black, this makes it black; You'll
   // have to say 'reset' or 'ls --color=auto' or something like that
@@ -576,7 +682,8 @@ static void printprogress(const unsigned int sofar,
            "%s: %7.*f%% "
            "So far: %9s "
            "%c[%s;%s;40mEst total: %9s "
-           "ETA: %9s%c[0;37;40m  "
+           "ETA: %9s%c[0;37;40m "
+           "%s "
            "*\n",
 
            taskname,
@@ -593,14 +700,17 @@ static void printprogress(const unsigned int sofar,
            disptot, 
 
            dispeta,
-           0x1b
+           0x1b,
+
+           disprate
     );
   else
     printf("*"
            "%s: %7.*f%% "
            "So far: %9s  "
            "Est total: %9s "
-           "ETA: %9s  "
+           "ETA: %9s "
+           "%s "
            "*\n",
 
            taskname,
@@ -608,63 +718,197 @@ static void printprogress(const unsigned int sofar,
            /* The percentage */
            ep-1 > 0? ep-1: 0, 
            round(pow(10, ep+1)*frac)/pow(10, ep-1),
-           dispelapsed, disptot, dispeta
+           dispelapsed, disptot, dispeta, disprate
     ); 
  
   fflush(stdout);
 
-  free(dispelapsed);
-  free(dispeta);
-  free(disptot);
+  p.oldtime = newtime;
+  p.lastfrac = frac;
+}
+
+/* Send p's metrics, every so often, one JSON object per line, to
+'dest', which is either a file name, to which they are appended, or
+"unix:" and the name of a Unix socket that something is listening on.
+Exits if it can't be opened. Must be called before startprogress(). */
+void progress_metrics(progress & p, const char * const dest,
+                      const double period)
+{
+  const char unixprefix[] = "unix:";
+  const size_t nprefix = sizeof unixprefix - 1;
+
+  p.metricssocket = !strncmp(dest, unixprefix, nprefix);
+  if(p.metricssocket){
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if(strlen(dest + nprefix) >= sizeof addr.sun_path){
+      fprintf(stderr, "Metrics socket name %s is too long\n", dest + nprefix);
+      exit(1);
+    }
+    strcpy(addr.sun_path, dest + nprefix);
+
+    p.metricsfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(p.metricsfd < 0 ||
+       connect(p.metricsfd, (sockaddr *)&addr, sizeof addr)){
+      fprintf(stderr, "Could not connect to metrics socket %s: %s\n",
+              dest + nprefix, strerror(errno));
+      exit(1);
+    }
+  }
+  else{
+    p.metricsfd = open(dest, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if(p.metricsfd < 0){
+      fprintf(stderr, "Could not open metrics file %s: %s\n", dest,
+              strerror(errno));
+      exit(1);
+    }
+  }
+
+  p.metrics = true;
+  p.metricsperiod = period;
+}
+
+/* The resident memory of this process, in bytes, or zero if we can't
+tell */
+static uint64_t rss_bytes()
+{
+  FILE * const statm = fopen("/proc/self/statm", "r");
+  if(!statm) return 0;
+  unsigned long size, resident;
+  const bool ok = fscanf(statm, "%lu %lu", &size, &resident) == 2;
+  fclose(statm);
+  return ok? uint64_t(resident)*sysconf(_SC_PAGESIZE): 0;
+}
+
+/* Write one line of metrics for p. The ETA is worked out the same way
+as for the printed reports, with the rate since the last line standing
+in for the rate since the last report. If the metrics can't be written,
+say so and stop writing them, since whatever is reading them shouldn't
+stop the processing. */
+static void writemetrics(progress & p, const bool last)
+{
+  const double newtime = now_seconds();
+  const double tottime = newtime - p.firsttime;
+  const double inctime = newtime - p.metricstime;
+  const uint64_t done = progress_load(p.done);
+
+  const double frac = p.total? double(done)/p.total: 1;
+  const double lastfrac = p.total? double(p.metricsdone)/p.total: 1;
+  int etas = -1;
+  if(last) etas = 0;
+  else if(frac > 0 && frac < 1){
+    const double tote = tottime/frac - tottime;
+    const double ince = frac > lastfrac?
+                        (1-frac)*inctime/(frac-lastfrac): -1;
+    etas = etasec(ince, tote, frac);
+  }
+
+  char buf[4*CHARMAX];
+  const int len = snprintf(buf, sizeof buf,
+    "{\"task\":\"%s\",\"time\":%.3f,\"elapsed\":%.3f,"
+    "\"events\":%lu,\"total\":%u,\"events_per_s\":%.1f,"
+    "\"bytes\":%lu,\"errors\":%lu,\"sync_pulses\":%lu,\"no_xy\":%lu,"
+    "\"rss\":%lu,\"eta\":%d,\"final\":%s}\n",
+    p.taskname, newtime, tottime,
+    (unsigned long)done, p.total,
+    last? done/tottime: (done - p.metricsdone)/inctime,
+    (unsigned long)progress_load(p.bytes),
+    (unsigned long)progress_load(p.nerror),
+    (unsigned long)progress_load(p.nsync),
+    (unsigned long)progress_load(p.nnoxy),
+    (unsigned long)rss_bytes(), etas, last? "true": "false");
+
+  // A reader that goes away must not get us killed with SIGPIPE
+  const ssize_t wrote = p.metricssocket?
+    send(p.metricsfd, buf, len, MSG_NOSIGNAL): write(p.metricsfd, buf, len);
+  if(wrote != len){
+    fprintf(stderr, "Could not write metrics, so no longer writing them\n");
+    close(p.metricsfd);
+    p.metrics = false;
+  }
+
+  p.metricstime = newtime;
+  p.metricsdone = done;
+}
+
+/* Wakes up every so often and prints a report if we've gotten past one
+of the print points since the last look. The last print point is left
+for finishprogress(). */
+static void * progress_reporter(void * arg)
+{
+  progress & p = *static_cast<progress *>(arg);
+  pthread_mutex_lock(&p.mutex);
+  while(!p.stop){
+    timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += REPORTER_PERIOD_MS*1000000L;
+    until.tv_sec += until.tv_nsec/1000000000L;
+    until.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&p.wake, &p.mutex, &until);
+    if(p.stop) break;
+
+    const uint64_t done = progress_load(p.done);
+    bool due = false;
+    while(p.ppoints.size() > 1 && p.ppoints[0] < done){
+      p.ppoints.erase(p.ppoints.begin());
+      due = true;
+    }
+    if(due && done < p.total) printprogress(p, done - 1);
 
-  oldtime = newtime;
-  lastfrac = frac;
+    if(p.metrics && now_seconds() - p.metricstime >= p.metricsperiod)
+      writemetrics(p, false);
+  }
+  pthread_mutex_unlock(&p.mutex);
+  return NULL;
 }
 
-void initprogressindicator(const unsigned int totin, const int maxe)
+/* Start reporting the progress of a task of 'totin' events, done by
+nworker workers, with at most maxe digits in the reports. */
+void startprogress(progress & p, const unsigned int totin, const int maxe,
+                   const int nworker, const char * const taskname)
 {
   if     (maxe > 9) fprintf(stderr, "maxe may not be > 9. Using 9\n");
   else if(maxe < 1) fprintf(stderr, "maxe may not be < 1. Using 1\n");
     
-  nopreviousestimate = true;
-  total = totin;
-  ppoints = generateprintpoints(total, maxe>9? 9: maxe<1? 1: maxe);
-  nextprint = ppoints[0];
-
-  struct timeval brokenfirsttime;
-  gettimeofday(&brokenfirsttime, NULL); 
-  firsttime = brokenfirsttime.tv_sec + 1e-6 * brokenfirsttime.tv_usec;
-
-  oldtime = firsttime;
-  lastfrac = 0;
+  p.done = p.bytes = 0;
+  p.nerror = p.nsync = p.nnoxy = 0;
+  p.workers.assign(nworker, workercount());
+  for(int i = 0; i < nworker; i++) p.workers[i].n = 0;
+  p.total = totin;
+  p.taskname = taskname;
+  p.stop = false;
+
+  p.previousprint = -1;
+  p.ppoints = generateprintpoints(p.total, maxe>9? 9: maxe<1? 1: maxe);
+  p.firsttime = p.oldtime = now_seconds();
+  p.lastfrac = 0;
+  p.lastdone = p.lastbytes = 0;
+  p.lastworkers.assign(nworker, 0);
+  p.metricstime = p.firsttime;
+  p.metricsdone = 0;
+
+  pthread_mutex_init(&p.mutex, NULL);
+  pthread_cond_init(&p.wake, NULL);
+  if(pthread_create(&p.reporter, NULL, progress_reporter, &p)){
+    fprintf(stderr, "Could not start progress thread\n");
+    exit(1);
+  }
 }
 
-// Print progress report if appropriate.  For best results, include this
-// In your loop *after* the work of the loop is done and call it on 
-// every iteration.
-// 
-// If this does not print, all it does is compares two integers and then
-// returns. The exception to this is if it is not printing because not
-// enough time has elapsed since the previous print. This is about as
-// rare as the prints themselves, so not a performance concern.
-//
-// inline makes a serious impact (factor of 10 improvement), at least if
-// using -O2 and if this cpp file is included directly rather than via
-// the header. (If using the header, this file is compiled separately
-// and so *can't* be inlined.)
-//
-// Without inline, with or without including this file directly, it is
-// a factor of 2 speed improvement to have printprogress as a separate
-// function, presumably because we don't invalidate as much of the cache
-// or pipeline or something by having a big dangling function body that
-// turns out to be unused.
-#ifdef PROGRESS_INDICATOR_HEADER_USED
-  void progressindicator(const unsigned int sofar,
-                         const char * const taskname)
-#else
-  inline void progressindicator(const unsigned int sofar,
-                                const char * const taskname)
-#endif
+/* Stop the reporter and print the final report, with the total time
+and average rates, and write the final metrics. */
+void finishprogress(progress & p)
 {
-  if(sofar == nextprint) printprogress(sofar, taskname);
+  pthread_mutex_lock(&p.mutex);
+  p.stop = true;
+  pthread_cond_signal(&p.wake);
+  pthread_mutex_unlock(&p.mutex);
+  pthread_join(p.reporter, NULL);
+
+  if(p.total) printprogress(p, p.total - 1);
+  if(p.metrics) writemetrics(p, true);
+
+  pthread_mutex_destroy(&p.mutex);
+  pthread_cond_destroy(&p.wake);
 }
@@ -0,0 +1,143 @@
+/**
+  \author Matthew Strait
+  \brief What otc computes for each event.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "otc_reco.h"
+#include "otc_geom.h"
+#include "otc_kernels.h"
+
+void lastpos(otc_output_event & __restrict__ out,
+             const otc_event_view & __restrict__ hits)
+{
+  // This is only called for events without errors, so the hits are in
+  // time order, and those in the last clock cycle are all at the end.
+  // Look only at them.
+  const int lasttime = hits.Time[hits.nhit-1];
+  unsigned int i = hits.nhit - 1;
+  while(i > 0 && hits.Time[i-1] == lasttime) i--;
+
+  const otc_stripgeom * const far = otc_farthest_strip(hits, i);
+  if(!far) return;
+  out.lastx = int(far->x);
+  out.lasty = int(far->y);
+  out.lastz = int(far->z);
+}
+
+/* See comments for is_sync_pulse() in
+DOGS/DCReco/DCOVNuMerger/DCOVNuMerger.cc */
+bool is_sync_pulse(const otc_event_view & hits)
+{
+  // Must have some number of trigger boxes each throwing 32 hits
+  if(hits.nhit == 0 || hits.nhit%32 != 0) return false;
+
+  for(unsigned int i = 0; i < hits.nhit; i++){
+    // Must not have any ordinary hits
+    if(hits.Status[i] == 2) return false;
+
+    const int first_tb_channel = 20000;
+
+    // Must have a hit in the highest invalid channel
+    if((hits.ChNum[i]-first_tb_channel)%100 == 31) return true; 
+  }
+
+  // In the extraordinary case that there are a multiple of 32 hits, all
+  // of them are from trigger boxes, but none are in invalid channels,
+  // this must be a highly improbable real event with many edge strip
+  // triggers.
+  return false;
+}
+
+/* Say what is wrong with each hit that has a bad channel number or is
+out of time order. Only called for events where otc_count_hits() found
+such hits, so it needn't be fast. It prints, so it is called as events
+are written out in order, not from the worker threads. */
+void report_bad_hits(const otc_event_view & hits)
+{
+  for(unsigned int i = 0; i < hits.nhit; i++){
+    if(!otc_geom(hits.ChNum[i], otc_kind(hits.Status[i], true)).valid)
+      printf("Bad channel number %u, nhit = %d\n", hits.ChNum[i], hits.nhit);
+
+    if(i > 0 && hits.Time[i] < hits.Time[i-1])
+      printf("Hits %d and %d of %d out of order with times %d and %d\n",
+             i, i-1, hits.nhit, hits.Time[i-1], hits.Time[i]);
+  }
+}
+
+bool do_hits_stuff(otc_output_event & __restrict__ out,
+                   const otc_event_view & __restrict__ hits,
+                   const bool hasxy)
+{
+  // Should not happen for data, but can happen in Monte Carlo
+  if(hits.nhit == 0) return false;
+
+  if(is_sync_pulse(hits)) return false;
+
+  otc_hitcounts c;
+  otc_count_hits(c, hits);
+  out.nhitup += c.nhitup;
+  out.nhitlo += c.nhitlo;
+
+  const bool badhits = c.nbad || c.nunordered;
+  if(badhits) out.error = true;
+
+  // For variables other than nhit{lo,up}, no one is interested in
+  // events without XY overlaps and it saves oodles of disk space not to
+  // store the answers for events without.
+  if(!hasxy) return badhits;
+
+  out.length = hits.Time[hits.nhit-1] - hits.Time[0] + 1;
+
+  if(!out.error) lastpos(out, hits);
+  return badhits;
+}
+
+// Everything that otc computes, and which input columns computing it
+// needs. Only columns that something here needs are read at all.
+struct otc_quantity {
+  const char * name;
+  unsigned int columns;
+};
+
+// Sync pulses are recognized by their channels and statuses and left
+// out of everything, so every quantity needs those.
+static const otc_quantity quantities[] = {
+  { "nhitup", OTC_COL_CHNUM | OTC_COL_STATUS },
+  { "nhitlo", OTC_COL_CHNUM | OTC_COL_STATUS },
+  { "error",  OTC_COL_CHNUM | OTC_COL_STATUS | OTC_COL_TIME },
+  { "length", OTC_COL_CHNUM | OTC_COL_STATUS | OTC_COL_TIME },
+
+  // These are only filled for events without errors
+  { "lastx",  OTC_COL_CHNUM | OTC_COL_STATUS | OTC_COL_TIME },
+  { "lasty",  OTC_COL_CHNUM | OTC_COL_STATUS | OTC_COL_TIME },
+  { "lastz",  OTC_COL_CHNUM | OTC_COL_STATUS | OTC_COL_TIME },
+};
+
+/* The input columns needed for all of the quantities */
+unsigned int needed_columns()
+{
+  unsigned int columns = 0;
+  for(unsigned int i = 0; i < sizeof quantities/sizeof *quantities; i++)
+    columns |= quantities[i].columns;
+  return columns;
+}
+
+otc_output_event doit(const otc_event_view & inevent, const bool readok,
+                      bool & badhits)
+{
+  otc_output_event out;
+  memset(&out, 0, sizeof(out));
+
+  // Events that couldn't be read, or had a charge or time that didn't
+  // fit in an int, have the error flag set so that the output stays in
+  // step with the input. Only an entry that couldn't be read at all is
+  // empty. The other kind keep their hits, with the bad values zeroed,
+  // and still get hit counts and a length.
+  out.error = !readok;
+
+  badhits = do_hits_stuff(out, inevent, !!inevent.nxy);
+
+  return out;
+}
@@ -0,0 +1,46 @@
+/**
+  \author Matthew Strait
+  \brief What otc computes for each event.
+
+  None of this does any I/O or needs ROOT, so it can be run on events
+  from anywhere, including the synthetic ones in the benchmarks. It
+  uses the geometry table and the kernels, so otc_kernels_init() must
+  have been called first.
+*/
+
+#ifndef OTC_RECO_H
+#define OTC_RECO_H
+
+#include "otc_cont.h"
+
+/// Fill in the position of the strip farthest from the chimney among
+/// those hit in the last clock cycle. The hits must be in time order.
+void lastpos(otc_output_event & __restrict__ out,
+             const otc_event_view & __restrict__ hits);
+
+/// Whether the event is a trigger box sync pulse rather than a muon
+bool is_sync_pulse(const otc_event_view & hits);
+
+/// Fill in everything about an event that comes from its hits. If
+/// !hasxy, only the hit counts and error flag are filled in. Returns
+/// whether any hits have bad channel numbers or are out of time order,
+/// which report_bad_hits() says more about.
+bool do_hits_stuff(otc_output_event & __restrict__ out,
+                   const otc_event_view & __restrict__ hits,
+                   const bool hasxy);
+
+/// Say what is wrong with each hit that has a bad channel number or is
+/// out of time order
+void report_bad_hits(const otc_event_view & hits);
+
+/// The input columns, as OTC_COL_ bits, that computing everything needs
+unsigned int needed_columns();
+
+/// Compute everything for one event. If !readok, the event has its
+/// error flag set. It was either unreadable, and is empty, or had
+/// values that didn't fit in an int, which are zeroed. badhits is set as by the
+/// return value of do_hits_stuff().
+otc_output_event doit(const otc_event_view & inevent, const bool readok,
+                      bool & badhits);
+
+#endif
@@ -12,242 +12,897 @@ using namespace std;
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <vector>
+#include <algorithm>
 #include "TSystem.h"
-#include "TChain.h"
 #include "TFile.h"
 #include "TError.h"
 #include "TClonesArray.h"
+#include "TLeaf.h"
+#include "TKey.h"
+#include "TROOT.h"
+#include "RVersion.h"
 #include "otc_cont.h"
+#include "otc_arena.h"
+#include "otc_kernels.h"
+#include "otc_io.h"
+#include "otc_timing.h"
+#include "otc_manifest.h"
 
 
 namespace {
-  otc_input_event inevent;
-  otc_output_event outevent;
-
-  // These are needed to get the ADC counts and clock ticks out of the
-  // muon.root files before we cast them to integers and put them in
-  // inevent.
-  double floatingQ[MAXOVHITS], floatingTime[MAXOVHITS];
-  vector<TTree *> hitchain;
+  // Where one reader is in one of the chains of TTrees.
+  struct chainpos {
+    TTree * curtree;
+    int curtreeindex;
+    uint64_t offset, nextbreak;
+  };
+
+  // Everything needed to read events out of the input chains. This used
+  // to be spread between function statics in get_hits() and get_reco()
+  // and file-level globals, which is fine for one caller marching
+  // through the events, but not if anyone else is to touch an event
+  // while the next one is being read.
+  struct otc_reader {
+    chainpos hitpos, recopos;
+
+    TBranch * hitcountbr, * qbr, * timebr, * chbr, * statbr;
+    TBranch * xycountbr, * nhitbr, * hitsbr;
+
+    // The number of hits and XY overlaps are read into these
+    int nhitcount, nxycount;
+
+    // Whether the ADC counts and clock ticks are stored as integers in
+    // the current TTree. So far they have always been doubles, which
+    // are converted as they are read.
+    bool qisint, timeisint;
+  };
+
+  // Output events waiting to be filled into the output tree by the
+  // background thread. Events tail-1 back to head are in the ring,
+  // at their number modulo its size.
+  struct fillqueue {
+    vector<otc_output_event> ring;
+    uint64_t head, tail;
+    bool done;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t notempty, notfull;
+  };
+
+  // Everything needed to write the output file
+  struct otc_writer {
+    TFile * outfile;
+    TTree * recotree, * summarytree;
+
+    // The output branches are bound to this
+    otc_output_event outevent;
+
+    // ROOT's compression setting, 100*algorithm + level. The default of
+    // 9 is zlib at its slowest, as it always was.
+    int compression;
+
+    // Buffer size for each output branch. Zero for ROOT's default.
+    int basketsize;
+
+    // Whether to fill the tree, and so compress its baskets, on a
+    // background thread
+    bool background;
+    fillqueue queue;
+
+    // Whether rows carry their event number and only some events get
+    // them, with the rest in range summaries. The summaries are held
+    // until a checkpoint or the end, when the background thread is
+    // idle, so that they can't be filled into their tree at the same
+    // time as it fills the main one. 'summary' is what they are filled
+    // from.
+    bool sparse;
+    vector<otc_range_summary> summaries;
+    otc_range_summary summary;
+  };
+
+  otc_reader reader;
+  otc_writer writer = { NULL, NULL, NULL, otc_output_event(), 9, 0, false,
+                        fillqueue(), false, vector<otc_range_summary>(),
+                        otc_range_summary() };
+
+  // Which of the input columns to read, from the OTC_COL_ bits. The
+  // rest are never read, decompressed or cached.
+  unsigned int incolumns = OTC_COL_ALL;
+
+  // If nonzero, the number of threads that ROOT may use to decompress
+  // input baskets ahead of when we need them.
+  int unzipthreads = 0;
+
+  // One input file. How many entries its trees have is found for all
+  // of the files at once when we start, but each is only opened for
+  // reading when we get to it.
+  struct inputfile {
+    const char * name;
+    uint64_t nhit, nreco;
+    bool ismc;
+
+    // If it couldn't be scanned, what is wrong with it
+    const char * error;
+
+    // Null except while the file is being read or is about to be. The
+    // file owns the trees.
+    TFile * file;
+    TTree * hittree, * recotree;
+  };
+
+  vector<inputfile> inputs;
+
+  // The first event number of each file's hit or reco tree, and then
+  // the total
   vector<uint64_t> hitchain_entries;
-  vector<TTree *> recochain;
   vector<uint64_t> recochain_entries;
   bool inputismc = false;
 
-  // Needed for writing the output file
-  TFile * outfile;
-  TTree * recotree;
+  // The next file for a scanning thread to take
+  int scannext;
+
+  // The files that are open, which are only ever the ones that the
+  // reader is in and the next one. However long the list of files,
+  // only these take up memory and file descriptors.
+  vector<int> openinputs;
+
+  // The file being opened ahead of time on another thread, or -1
+  int prefetchindex = -1;
+  pthread_t prefetchthread;
 }; 
 
-static void get_hits(const uint64_t current_event)
+/* Open input file i for reading, if it isn't already, and check that it
+is as it was when we started. */
+static void open_input(const int i)
+{
+  inputfile & in = inputs[i];
+  if(in.file) return;
+
+  in.file = new TFile(in.name, "read");
+  if(!in.file || in.file->IsZombie()){
+    fprintf(stderr, "%s became a zombie when ROOT tried to read it.\n",
+            in.name);
+    _exit(1);
+  }
+
+  in.hittree = dynamic_cast<TTree*>(in.file->Get("OVHitInfoTree"));
+  in.recotree = dynamic_cast<TTree*>(in.file->Get("RecoOVInfoTree"));
+  if(!in.hittree || !in.recotree ||
+     (uint64_t)in.hittree->GetEntries() != in.nhit ||
+     (uint64_t)in.recotree->GetEntries() != in.nreco){
+    fprintf(stderr, "%s changed while otc was running\n", in.name);
+    _exit(1);
+  }
+}
+
+/* Opens the file at prefetchindex, so that the reader doesn't have to
+wait for it when it gets there */
+static void * prefetch_thread(__attribute__((unused)) void * arg)
+{
+  open_input(prefetchindex);
+  return NULL;
+}
+
+/* Wait until the file being opened ahead of time, if any, is open */
+static void finish_prefetch()
+{
+  if(prefetchindex < 0) return;
+  pthread_join(prefetchthread, NULL);
+  prefetchindex = -1;
+}
+
+/* Start opening the first file with events after file i, unless it is
+already open. */
+static void start_prefetch(const int i)
+{
+  int next = i + 1;
+  while(next < (int)inputs.size() && !inputs[next].nhit &&
+        !inputs[next].nreco) next++;
+  if(next >= (int)inputs.size() || next == prefetchindex ||
+     inputs[next].file) return;
+
+  finish_prefetch();
+  prefetchindex = next;
+  if(pthread_create(&prefetchthread, NULL, prefetch_thread, NULL)){
+    // Then it will be opened when we get to it
+    prefetchindex = -1;
+    return;
+  }
+  openinputs.push_back(next);
+}
+
+/* Open input file i, or wait for it to finish opening if that has
+already been started. */
+static void use_input(const int i)
+{
+  if(i == prefetchindex) finish_prefetch();
+  if(inputs[i].file) return;
+  open_input(i);
+  openinputs.push_back(i);
+}
+
+/* Close the open input files that the reader is done with */
+static void close_finished_inputs(const otc_reader & r)
+{
+  for(unsigned int k = 0; k < openinputs.size(); ){
+    const int i = openinputs[k];
+    if(i == prefetchindex ||
+       (r.hitpos.curtree && i == r.hitpos.curtreeindex) ||
+       (r.recopos.curtree && i == r.recopos.curtreeindex)){
+      k++;
+      continue;
+    }
+
+    delete inputs[i].file;
+    inputs[i].file = NULL;
+    inputs[i].hittree = inputs[i].recotree = NULL;
+    openinputs.erase(openinputs.begin() + k);
+  }
+}
+
+/* Make pos point at the hit TTree, or the reco TTree if not 'hit', that
+has event number current_event, opening its file if need be. Return
+true if this is a different TTree than before, in which case the caller
+must find its branches again. */
+static bool seek_tree(chainpos & pos, const vector<uint64_t> & chain_entries,
+                      const bool hit, const uint64_t current_event)
+{
+  if(pos.curtree && current_event >= pos.offset &&
+     current_event < pos.nextbreak) return false;
+
+  // chain_entries has the first event number of each TTree, and then
+  // the total. The TTree we want is the last one that starts at or
+  // before current_event, which also steps over any empty TTrees, since
+  // they start in the same place as the one after them.
+  const int i = upper_bound(chain_entries.begin(), chain_entries.end() - 1,
+                            current_event) - chain_entries.begin() - 1;
+
+  use_input(i);
+  pos.curtreeindex = i;
+  pos.curtree = hit? inputs[i].hittree: inputs[i].recotree;
+  pos.offset = chain_entries[i];
+  pos.nextbreak = chain_entries[i+1];
+  return true;
+}
+
+/* Read the counts of entries local through local+n-1 of countbr, which
+is the top branch of a split TClonesArray whose count is read into
+'count', and make offsets such that entry i's elements are offset[i]
+through offset[i+1]-1. Return the total count. Entries that can't be
+read get a count of zero and are marked in readok. */
+static unsigned int read_counts(TBranch * const countbr, const int & count,
+                                unsigned int * const offset,
+                                const uint64_t local, const unsigned int n,
+                                bool * const readok)
+{
+  offset[0] = 0;
+  for(unsigned int i = 0; i < n; i++){
+    // TBranch::GetEntry, as opposed to TBranchElement::GetEntry, reads
+    // just the TClonesArray's count and not all of its members.
+    const bool ok = countbr->TBranch::GetEntry(local+i) > 0 && count >= 0;
+    if(!ok) readok[i] = false;
+    offset[i+1] = offset[i] + (ok? count: 0);
+  }
+  return offset[n];
+}
+
+/* Read entries local through local+n-1 of br, a member of a split
+TClonesArray, into col, with entry i going to col + offset[i]. */
+template<class T> static void read_column(TBranch * const br, T * const col,
+                                          const unsigned int * const offset,
+                                          const uint64_t local,
+                                          const unsigned int n,
+                                          bool * const readok)
+{
+  for(unsigned int i = 0; i < n; i++){
+    // A member branch only reads as many elements as its TClonesArray's
+    // count for this entry, which it reads first if it needs to, so
+    // there's no way for this to run past the end of the column. In
+    // MakeClass mode, moving a branch to a new address is just a
+    // couple of assignments.
+    //
+    // Since read_counts() has left the count branch at the last entry,
+    // it does need to, for every entry but the last, and does so again
+    // for each member. That is an extra count read per member per
+    // event, the price of going through one branch at a time. The
+    // count reads are from a basket that is already in memory, unlike
+    // the member reads they save jumping between.
+    if(offset[i+1] == offset[i]) continue;
+    br->SetAddress(col + offset[i]);
+    if(br->GetEntry(local+i) < 0) readok[i] = false;
+  }
+}
+
+/* Read a column that we want as ints, and which is stored either as
+ints or as doubles, as with read_column(). Doubles are read into memory
+big enough for them and converted to ints in place, so there is never a
+second copy of the column. Values that don't fit in an int are set to
+zero and their events are marked in readok. 'what' names the quantity
+for complaining about such values. */
+static int * read_int_column(TBranch * const br, const bool isint,
+                             const char * const what,
+                             const unsigned int * const offset,
+                             const uint64_t first, const uint64_t local,
+                             const unsigned int n, bool * const readok,
+                             otc_arena & arena)
+{
+  const unsigned int count = offset[n];
+
+  if(isint){
+    int * const col = otc_arena_alloc<int>(arena, count);
+    read_column(br, col, offset, local, n, readok);
+    return col;
+  }
+
+  double * const raw = otc_arena_alloc<double>(arena, count);
+  read_column(br, raw, offset, local, n, readok);
+  int * const col = reinterpret_cast<int *>(raw);
+
+  unsigned int done = 0;
+  while((done += otc_doubles_to_ints(col + done, raw + done, count - done))
+        < count){
+    const unsigned int ev =
+      upper_bound(offset, offset + n + 1, done) - offset - 1;
+    if(readok[ev])
+      fprintf(stderr, "Event %lu has %s %g, which doesn't fit in an int\n",
+              (unsigned long)(first + ev), what, raw[done]);
+    readok[ev] = false;
+    col[done++] = 0;
+  }
+  return col;
+}
+
+/* Read the hits of n events starting with first into b, which has its
+offsets and readok already allocated. All the events must be in the
+current TTree. */
+static void get_hits(otc_reader & r, otc_event_batch & b,
+                     unsigned int * const hitoffset, bool * const readok,
+                     const uint64_t first, const unsigned int n,
+                     otc_arena & arena)
+{
+  const uint64_t local = first - r.hitpos.offset;
+
+  const unsigned int nhit =
+    read_counts(r.hitcountbr, r.nhitcount, hitoffset, local, n, readok);
+
+  unsigned int * ChNum = NULL;
+  unsigned short * Status = NULL;
+  int * Q = NULL, * Time = NULL;
+
+  if(r.chbr){
+    ChNum = otc_arena_alloc<unsigned int>(arena, nhit);
+    read_column(r.chbr, ChNum, hitoffset, local, n, readok);
+  }
+  if(r.statbr){
+    Status = otc_arena_alloc<unsigned short>(arena, nhit);
+    read_column(r.statbr, Status, hitoffset, local, n, readok);
+  }
+  if(r.qbr)
+    Q = read_int_column(r.qbr, r.qisint, "charge", hitoffset, first, local,
+                        n, readok, arena);
+  if(r.timebr)
+    Time = read_int_column(r.timebr, r.timeisint, "time", hitoffset, first,
+                           local, n, readok, arena);
+
+  for(unsigned int i = 0; i < n; i++){
+    const unsigned int evnhit = hitoffset[i+1] - hitoffset[i];
+    if(evnhit > MAXOVHITS){
+      fprintf(stderr, "Crazy event %lu with %u hits! Processing it anyway.\n",
+              (unsigned long)(first+i), evnhit);
+    }
+    else if(evnhit == 0 && readok[i] && !inputismc){
+      fprintf(stderr, "Event with no hits. Unexpected in data. Is this Monte "
+              "Carlo missing OVHitThInfoTree?\n");
+    }
+  }
+
+  b.ChNum = ChNum;
+  b.Status = Status;
+  b.Q = Q;
+  b.Time = Time;
+}
+
+/* Read the XY overlaps of n events starting with first into b, as with
+get_hits(). */
+static void get_reco(otc_reader & r, otc_event_batch & b,
+                     unsigned int * const xyoffset, bool * const readok,
+                     const uint64_t first, const unsigned int n,
+                     otc_arena & arena)
+{
+  const uint64_t local = first - r.recopos.offset;
+
+  const unsigned int nxy =
+    read_counts(r.xycountbr, r.nxycount, xyoffset, local, n, readok);
+
+  int * xy_nhit = NULL;
+  int (* xy_hits)[OTC_MAXXYHIT] = NULL;
+
+  if(r.nhitbr){
+    xy_nhit = otc_arena_alloc<int>(arena, nxy);
+    read_column(r.nhitbr, xy_nhit, xyoffset, local, n, readok);
+  }
+  if(r.hitsbr){
+    xy_hits = reinterpret_cast<int (*)[OTC_MAXXYHIT]>(
+      otc_arena_alloc<int>(arena, nxy*OTC_MAXXYHIT));
+    read_column(r.hitsbr, xy_hits, xyoffset, local, n, readok);
+  }
+
+  for(unsigned int i = 0; i < n; i++)
+    if(xyoffset[i+1] - xyoffset[i] > OTC_MAX_RECO_OV_OBJ)
+      fprintf(stderr, "AAAAahhhh %u XY overlaps in event %lu!\n",
+              xyoffset[i+1] - xyoffset[i], (unsigned long)(first+i));
+
+  b.xy_nhit = xy_nhit;
+  b.xy_hits = xy_hits;
+}
+
+// Size of the read-ahead cache for each input TTree when decompressing
+// in parallel. Needs to hold several baskets of each branch we read so
+// that there is something to be working on while we use the others.
+static const int UNZIP_CACHE_BYTES = 64*1024*1024;
+
+/* Have ROOT read ahead the baskets of these branches of tree and
+decompress them on other threads, so that by the time we GetEntry
+them, their buffers are already inflated. Null branches, which we
+aren't reading, are skipped. */
+static void prefetch_branches(TTree * const tree,
+                              TBranch * const * const brs, const int nbr)
+{
+  // Which kind of cache SetCacheSize() makes depends on whether parallel
+  // unzipping is on at the time, so it has to come first.
+  tree->SetParallelUnzip(true);
+  tree->SetCacheSize(UNZIP_CACHE_BYTES);
+  for(int i = 0; i < nbr; i++) if(brs[i]) tree->AddBranchToCache(brs[i]);
+  tree->StopCacheLearningPhase();
+}
+
+/* Return the named branch of tree if column is one we're reading.
+Otherwise, turn the branch off and return null. */
+static TBranch * project_branch(TTree * const tree, const char * const name,
+                                const unsigned int column)
+{
+  if(incolumns & column) return tree->GetBranch(name);
+  tree->SetBranchStatus(name, 0);
+  return NULL;
+}
+
+/* Whether br holds ints, as opposed to the doubles that the ADC counts
+and clock ticks have always been stored as so far. Exits if it is
+neither. A null branch, which isn't being read, doesn't matter. */
+static bool branch_is_int(TBranch * const br)
+{
+  if(!br) return false;
+
+  TLeaf * const leaf = br->GetLeaf(br->GetName());
+  const char * const type = leaf? leaf->GetTypeName(): "";
+  if(!strcmp(type, "Int_t") || !strcmp(type, "int")) return true;
+  if(!strcmp(type, "Double_t") || !strcmp(type, "double") ||
+     !strcmp(type, "Double32_t")) return false;
+
+  fprintf(stderr, "%s has type \"%s\", but I can only read ints or doubles\n",
+          br->GetName(), type);
+  exit(1);
+}
+
+/* Find the branches of the TTrees that events starting with 'first'
+are in, if we've just moved into them. */
+static void find_branches(otc_reader & r, const uint64_t first)
 {
   // Go through some contortions for speed. Favor TBranch::GetEntry over
   // TTree::GetEntry, which loops through unused branches on every call.
   // Avoid using TChain to find the TTrees' branches on every call.
-  static TBranch * qbr = 0, * timebr = 0, * chbr = 0, 
-                 * statbr = 0;
-
-  static uint64_t offset = 0, nextbreak = 0;
-
-  // This allows reading randomly around in the current TTree or
-  // resetting to the first TTree, but random reads from one TTree to
-  // another will fail catastrophically.
-  if(current_event == 0 || current_event == nextbreak){
-    static TTree * curtree = 0;
-    static int curtreeindex = -1;
-    if(current_event == 0){
-      offset = nextbreak = 0;
-      curtreeindex = -1;
-    }
+  const bool hitmoved = seek_tree(r.hitpos, hitchain_entries, true, first);
+  if(hitmoved){
+    TTree * const curtree = r.hitpos.curtree;
+    curtree->SetMakeClass(1);
+    r.hitcountbr = curtree->GetBranch("OVHitInfoBranch");
+    r.chbr   = project_branch(curtree, "OVHitInfoBranch.fChNum",OTC_COL_CHNUM);
+    r.statbr = project_branch(curtree, "OVHitInfoBranch.fStatus",OTC_COL_STATUS);
+    r.qbr    = project_branch(curtree, "OVHitInfoBranch.fQ",    OTC_COL_Q);
+    r.timebr = project_branch(curtree, "OVHitInfoBranch.fTime", OTC_COL_TIME);
+    r.qisint = branch_is_int(r.qbr);
+    r.timeisint = branch_is_int(r.timebr);
 
-    curtree = hitchain[++curtreeindex];
-    nextbreak = hitchain_entries[curtreeindex+1];
-    offset = hitchain_entries[curtreeindex];
+    // The members are pointed at the right part of a column for each
+    // entry as it is read.
+    curtree->SetBranchAddress("OVHitInfoBranch", &r.nhitcount);
 
+    if(unzipthreads){
+      TBranch * const brs[] =
+        { r.hitcountbr, r.chbr, r.statbr, r.qbr, r.timebr };
+      prefetch_branches(curtree, brs, sizeof brs/sizeof *brs);
+    }
+  }
+
+  const bool recomoved = seek_tree(r.recopos, recochain_entries, false,first);
+  if(recomoved){
+    TTree * const curtree = r.recopos.curtree;
     curtree->SetMakeClass(1);
-    chbr   = curtree->GetBranch("OVHitInfoBranch.fChNum");
-    statbr = curtree->GetBranch("OVHitInfoBranch.fStatus");
-    qbr    = curtree->GetBranch("OVHitInfoBranch.fQ");
-    timebr = curtree->GetBranch("OVHitInfoBranch.fTime");
-    int dummy;
-    curtree->SetBranchAddress("OVHitInfoBranch", &dummy);
-    curtree->SetBranchAddress("OVHitInfoBranch.fChNum", inevent.hits.ChNum);
-    curtree->SetBranchAddress("OVHitInfoBranch.fStatus",inevent.hits.Status);
-    curtree->SetBranchAddress("OVHitInfoBranch.fQ",     floatingQ);
-    curtree->SetBranchAddress("OVHitInfoBranch.fTime",  floatingTime);
-  }
-
-  const uint64_t localentry = current_event - offset;
-
-  // Instead of getting the number of hits via
-  // TTree::SetBranchAddress("OVHitInfoBranch", &n), TTree::GetEntry(i),
-  // which has the unfortunate side effect of looping through all
-  // branches, determine it by the number of bytes read when getting
-  // something else.
-  //
-  // WARNING WARNING WARNING: I have empirically found that the array
-  // length is one less than it would seem from taking the number of
-  // bytes read. Maybe ROOT reads an end marker after the real data
-  // and counts that towards the byte count. In any case, I don't know
-  // whether I'm using a real feature here, or if this is just something
-  // that works by accident.
-  inevent.hits.nhit = chbr->GetEntry(localentry)/sizeof(unsigned int) - 1;
-
-  // It's awkward to avoid having already filled an array at the first
-  // moment that nhit is known. If the number of events is truly huge,
-  // it will segfault. However, if it's only a little too large, since
-  // inevent.hits.ChNum comes before several other arrays in OVEventForReco,
-  // we will usually survive and can abort more cleanly here.
-  if(inevent.hits.nhit > MAXOVHITS){
-    fprintf(stderr, "Crazy event with %d hits! I just ran "
-            "off the end of some arrays, so I'm bailing out!\n",
-             inevent.hits.nhit);
-    exit(1);
+    r.xycountbr = curtree->GetBranch("xy");
+    r.nhitbr = project_branch(curtree, "xy.nhit",     OTC_COL_XYNHIT);
+    r.hitsbr = project_branch(curtree, "xy.hits[16]", OTC_COL_XYHITS);
+    curtree->SetBranchAddress("xy", &r.nxycount);
+
+    if(unzipthreads){
+      TBranch * const brs[] = { r.xycountbr, r.nhitbr, r.hitsbr };
+      prefetch_branches(curtree, brs, sizeof brs/sizeof *brs);
+    }
   }
-  else if(inevent.hits.nhit == 0 && !inputismc){
-    fprintf(stderr, "Event with no hits. Unexpected in data. Is this Monte "
-            "Carlo missing OVHitThInfoTree?\n");
+
+  // Let go of the file we just left and get the next one ready
+  if(hitmoved || recomoved){
+    close_finished_inputs(r);
+    start_prefetch(max(r.hitpos.curtreeindex, r.recopos.curtreeindex));
   }
+}
 
-  statbr->GetEntry(localentry);
+/** Read up to n events starting with event number 'first' into b, using
+memory from arena. Reading is done one branch at a time over all the
+events, so that each branch's baskets are gone through in one go and
+the hits come out in columns. Fewer than n events are read if the
+end of a file comes first. Returns the number read. b is good until
+the arena is reset. */
+static unsigned int root_get_batch(otc_event_batch & b, const uint64_t first,
+                                   const unsigned int nwanted,
+                                   otc_arena & arena)
+{
+  const uint64_t hitstart = otc_timing_begin();
+  find_branches(reader, first);
+
+  unsigned int n = nwanted;
+  if(reader.hitpos.nextbreak - first < n)  n = reader.hitpos.nextbreak - first;
+  if(reader.recopos.nextbreak - first < n) n = reader.recopos.nextbreak - first;
+
+  unsigned int * const hitoffset = otc_arena_alloc<unsigned int>(arena, n+1);
+  unsigned int * const xyoffset  = otc_arena_alloc<unsigned int>(arena, n+1);
+  bool * const readok = otc_arena_alloc<bool>(arena, n);
+  for(unsigned int i = 0; i < n; i++) readok[i] = true;
+
+  get_hits(reader, b, hitoffset, readok, first, n, arena);
+  otc_timing_end(OTC_STAGE_READHITS, first, n, hitstart);
 
-  qbr->GetEntry(localentry);
-  for(unsigned int i = 0; i < inevent.hits.nhit; i++)
-    inevent.hits.Q[i] = int(floatingQ[i]); 
+  const uint64_t recostart = otc_timing_begin();
+  get_reco(reader, b, xyoffset, readok, first, n, arena);
+  otc_timing_end(OTC_STAGE_READRECO, first, n, recostart);
 
-  timebr->GetEntry(localentry);
-  for(unsigned int i = 0; i < inevent.hits.nhit; i++)
-    inevent.hits.Time[i] = int(floatingTime[i]);
+  for(unsigned int i = 0; i < n; i++)
+    if(!readok[i])
+      fprintf(stderr, "Could not read event %lu\n", (unsigned long)(first+i));
+
+  b.first = first;
+  b.n = n;
+  b.hitoffset = hitoffset;
+  b.xyoffset = xyoffset;
+  b.readok = readok;
+  return n;
 }
 
-void get_reco(const uint64_t current_event)
+// Number of output events that can be waiting for the background
+// thread before root_write_event() has to wait for it.
+static const unsigned int FILLQUEUE_SIZE = 1 << 14;
+
+/* Fills the output tree from writer.queue until told to stop and the
+queue is empty. Each time it wakes up, it takes everything that's
+waiting so that it only needs the lock once per bunch of events. */
+static void * fill_thread(__attribute__((unused)) void * arg)
 {
-  static TBranch * nhitbr = 0, * hitsbr = 0;
+  fillqueue & q = writer.queue;
+  pthread_mutex_lock(&q.mutex);
+  while(true){
+    while(q.head == q.tail && !q.done)
+      pthread_cond_wait(&q.notempty, &q.mutex);
+    if(q.head == q.tail) break;
 
-  static uint64_t offset = 0, nextbreak = 0;
+    const uint64_t from = q.head, to = q.tail;
+    pthread_mutex_unlock(&q.mutex);
 
-  if(current_event == 0 || current_event == nextbreak){
-    static TTree * curtree = 0;
-    static int curtreeindex = -1;
-    if(current_event == 0){
-      offset = nextbreak = 0;
-      curtreeindex = -1;
+    // The events were already timed as they were queued, so this only
+    // adds to the total time
+    const uint64_t start = otc_timing_begin();
+    for(uint64_t i = from; i < to; i++){
+      writer.outevent = q.ring[i % FILLQUEUE_SIZE];
+      writer.recotree->Fill();
     }
+    otc_timing_end(OTC_STAGE_FILL, from, 0, start);
 
-    curtree = recochain[++curtreeindex];
-    nextbreak = recochain_entries[curtreeindex+1];
-    offset = recochain_entries[curtreeindex];
-
-    curtree->SetMakeClass(1);
-    nhitbr = curtree->GetBranch("xy.nhit");
-    hitsbr = curtree->GetBranch("xy.hits[16]");
-    int dummy;
-    curtree->SetBranchAddress("xy", &dummy),
-    curtree->SetBranchAddress("xy.nhit", inevent.xy_nhit),
-    curtree->SetBranchAddress("xy.hits[16]", inevent.xy_hits);
+    pthread_mutex_lock(&q.mutex);
+    q.head = to;
+    pthread_cond_signal(&q.notfull);
   }
+  pthread_mutex_unlock(&q.mutex);
+  return NULL;
+}
 
-  const uint64_t localentry = current_event - offset;
-  inevent.nxy = nhitbr->GetEntry(localentry)/sizeof(int) - 1;
+static void start_fill_thread()
+{
+  // The output tree is filled on that thread while this one reads the
+  // input files, and both go through ROOT's global state
+  ROOT::EnableThreadSafety();
 
-  if(inevent.nxy > OTC_MAX_RECO_OV_OBJ){
-    fprintf(stderr, "AAAAahhhh %d XY overlaps!\n", inevent.nxy);
+  fillqueue & q = writer.queue;
+  q.ring.resize(FILLQUEUE_SIZE);
+  q.head = q.tail = 0;
+  q.done = false;
+  pthread_mutex_init(&q.mutex, NULL);
+  pthread_cond_init(&q.notempty, NULL);
+  pthread_cond_init(&q.notfull, NULL);
+  if(pthread_create(&q.thread, NULL, fill_thread, NULL)){
+    fprintf(stderr, "Could not start output thread\n");
     exit(1);
   }
+}
 
-  hitsbr->GetEntry(localentry);
+/* Wait until the background thread has filled everything it was given */
+static void drain_fill_thread()
+{
+  fillqueue & q = writer.queue;
+  pthread_mutex_lock(&q.mutex);
+  while(q.head != q.tail) pthread_cond_wait(&q.notfull, &q.mutex);
+  pthread_mutex_unlock(&q.mutex);
 }
 
+static void stop_fill_thread()
+{
+  fillqueue & q = writer.queue;
+  pthread_mutex_lock(&q.mutex);
+  q.done = true;
+  pthread_cond_signal(&q.notempty);
+  pthread_mutex_unlock(&q.mutex);
+  pthread_join(q.thread, NULL);
+}
 
-/** Make inevent the eventn'th event in the chain. */
-otc_input_event get_event(const uint64_t current_event)
+static void root_write_event(const otc_output_event & out)
 {
-  memset(&inevent, 0, sizeof(inevent));
-  get_hits(current_event);
-  get_reco(current_event);
+  if(!writer.background){
+    writer.outevent = out;
+    writer.recotree->Fill();
+    return;
+  }
 
-  return inevent;
+  fillqueue & q = writer.queue;
+  pthread_mutex_lock(&q.mutex);
+  while(q.tail - q.head == FILLQUEUE_SIZE)
+    pthread_cond_wait(&q.notfull, &q.mutex);
+  q.ring[q.tail++ % FILLQUEUE_SIZE] = out;
+  pthread_cond_signal(&q.notempty);
+  pthread_mutex_unlock(&q.mutex);
 }
 
-void write_event(const otc_output_event & out)
+/* If fname isn't the name of a muon.root file, say why not. Otherwise,
+return null. */
+const char * otc_root_bad_name(const char * const fname)
 {
-  outevent = out;
-  recotree->Fill();
+  if(strlen(fname) < 9) return "doesn't have the form *muon*.root";
+  if(!strstr(fname, "muon")) return "does not contain \"muon\"";
+  if(strcmp(fname + strlen(fname) - 5, ".root"))
+    return "does not end in \".root\"";
+  return NULL;
 }
 
-static uint64_t root_init_input(const char * const * const filenames,
-                                const int nfiles)
+// Number of threads that scan the input files when we start. This is
+// mostly waiting on the disk or the network file system, so it has
+// little to do with the number of cores.
+static const int SCAN_THREADS = 16;
+
+/* Find how many entries the trees of an input file have and whether it
+is Monte Carlo, which it is if it has a nonempty OVHitThInfoTree. The
+file is closed again, and anything wrong with it is left in in.error
+for the main thread to report. */
+static void scan_input(inputfile & in)
 {
-  TChain mctestchain("OVHitThInfoTree");
+  TFile * const f = new TFile(in.name, "read");
+  if(!f || f->IsZombie()){
+    in.error = "became a zombie when ROOT tried to read it.";
+    delete f;
+    return;
+  }
 
-  uint64_t totentries_hit = 0, totentries_reco = 0;
+  TTree * const hit = dynamic_cast<TTree*>(f->Get("OVHitInfoTree"));
+  TTree * const reco = dynamic_cast<TTree*>(f->Get("RecoOVInfoTree"));
+  if(!hit) in.error = "does not have an OVHitInfoTree tree";
+  else if(!reco) in.error = "does not have a RecoOVInfoTree tree";
+  else{
+    in.nhit = hit->GetEntries();
+    in.nreco = reco->GetEntries();
+
+    TTree * const truth = dynamic_cast<TTree*>(f->Get("OVHitThInfoTree"));
+    in.ismc = truth && truth->GetEntries() != 0;
+  }
+
+  delete f;
+}
+
+/* Scans input files, taking the next one not yet taken until there are
+none left */
+static void * scan_thread(__attribute__((unused)) void * arg)
+{
+  int i;
+  while((i = __atomic_fetch_add(&scannext, 1, __ATOMIC_RELAXED))
+        < (int)inputs.size())
+    scan_input(inputs[i]);
+  return NULL;
+}
 
+/* Find the events in the given files, setting nevent to how many there
+are. Returns false, having said why, if any of the files can't be read. */
+static bool root_init_input(const char * const * const filenames,
+                            const int nfiles, uint64_t & nevent)
+{
   for(int i = 0; i < nfiles; i++){
     const char * const fname = filenames[i];
-    if(strlen(fname) < 9){
-      fprintf(stderr, "%s doesn't have the form *muon*.root\n", fname);
-      _exit(1);
-    }
-    if(!strstr(fname, "muon")){
-      fprintf(stderr, "File name %s does not contain \"muon\"\n", fname);
-      _exit(1);
-    }
-    if(strstr(fname, ".root") != fname + strlen(fname) - 5){
-      fprintf(stderr, "File name %s does not end in \".root\"\n", fname);
-      _exit(1);
+    const char * const badname = otc_root_bad_name(fname);
+    if(badname){
+      fprintf(stderr, "File name %s %s\n", fname, badname);
+      return false;
     }
 
-    TFile * inputfile = new TFile(fname, "read");
-    if(!inputfile || inputfile->IsZombie()){
-      fprintf(stderr, "%s became a zombie when ROOT tried to read it.\n",fname);
-      _exit(1);
-    }
+    inputfile in = inputfile();
+    in.name = fname;
+    inputs.push_back(in);
+  }
 
-    TTree * temp=dynamic_cast<TTree*>(inputfile->Get("OVHitInfoTree"));
-    if(!temp){
-      fprintf(stderr, "%s does not have an OVHitInfoTree tree\n", fname);
+  // Opening the files one after the other, each one waiting on the
+  // disk, takes minutes when there are thousands of them.
+  ROOT::EnableThreadSafety();
+  scannext = 0;
+  const int nthread = min(nfiles, SCAN_THREADS);
+  vector<pthread_t> threads(nthread);
+  for(int i = 0; i < nthread; i++){
+    if(pthread_create(&threads[i], NULL, scan_thread, NULL)){
+      fprintf(stderr, "Could not start thread to scan input files\n");
       _exit(1);
     }
+  }
+  for(int i = 0; i < nthread; i++) pthread_join(threads[i], NULL);
 
-    hitchain_entries.push_back(totentries_hit);
-    hitchain.push_back(temp);
-    totentries_hit += temp->GetEntries();
+  uint64_t totentries_hit = 0, totentries_reco = 0;
 
-    temp = dynamic_cast<TTree*>(inputfile->Get("RecoOVInfoTree"));
-    if(!temp){
-      fprintf(stderr, "%s does not have a RecoOVInfoTree tree\n", fname);
-      _exit(1);
+  for(int i = 0; i < nfiles; i++){
+    const inputfile & in = inputs[i];
+    if(in.error){
+      fprintf(stderr, "%s %s\n", in.name, in.error);
+      return false;
     }
 
+    hitchain_entries.push_back(totentries_hit);
+    totentries_hit += in.nhit;
     recochain_entries.push_back(totentries_reco);
-    recochain.push_back(temp);
-    totentries_reco += temp->GetEntries();
-
-    {
-      const int old_geil = gErrorIgnoreLevel;
-      gErrorIgnoreLevel = kFatal;
-      mctestchain.Add(fname);
-      if(mctestchain.GetEntries() != 0) inputismc = true;
-      gErrorIgnoreLevel = old_geil; 
-    }
-
-    printf("Loaded %s\n", fname);
+    totentries_reco += in.nreco;
+    inputismc |= in.ismc;
   }
 
   if(totentries_hit != totentries_reco){
     fprintf(stderr, "ERROR: hit tree has %ld entries, but reco tree has %ld\n",
             totentries_hit, totentries_reco);
+    return false;
+  }
+
+  // Terminate the lists of starting entries so that the end of the last
+  // TTree can be found the same way as for all the others.
+  hitchain_entries.push_back(totentries_hit);
+  recochain_entries.push_back(totentries_reco);
+
+  printf("Found %lu events in %d file%s\n", (unsigned long)totentries_hit,
+         nfiles, nfiles == 1? "": "s");
+
+  nevent = totentries_hit;
+  return true;
+}
+
+/* A hash of the hit and reco trees of fname as they are stored on disk,
+which have in them the number of entries and where each basket is, so
+the hash changes if anything in the trees does. Reads only the trees'
+headers, not their baskets. Exits if the trees can't be read. */
+uint64_t otc_root_header_hash(const char * const fname)
+{
+  TFile * const inputfile = new TFile(fname, "read");
+  if(!inputfile || inputfile->IsZombie()){
+    fprintf(stderr, "%s became a zombie when ROOT tried to read it.\n",fname);
     exit(1);
   }
 
-  return totentries_hit;
+  uint64_t h = OTC_HASH_INIT;
+  const char * const treenames[] = { "OVHitInfoTree", "RecoOVInfoTree" };
+  for(unsigned int i = 0; i < sizeof treenames/sizeof *treenames; i++){
+    TKey * const key = inputfile->GetKey(treenames[i]);
+    if(!key){
+      fprintf(stderr, "%s does not have a%s %s tree\n", fname,
+              i? "": "n", treenames[i]);
+      exit(1);
+    }
+    vector<char> buf(key->GetNbytes());
+    if(inputfile->ReadBuffer(&buf[0], key->GetSeekKey(), buf.size())){
+      fprintf(stderr, "Could not read the %s header of %s\n", treenames[i],
+              fname);
+      exit(1);
+    }
+    h = otc_hash(&buf[0], buf.size(), h);
+  }
+
+  delete inputfile;
+  return h;
+}
+
+/* Close the input files, which deletes their TTrees, and forget about
+them, so that other input can be opened. */
+static void root_close_input()
+{
+  finish_prefetch();
+  for(unsigned int i = 0; i < openinputs.size(); i++)
+    delete inputs[openinputs[i]].file;
+  openinputs.clear();
+  inputs.clear();
+  hitchain_entries.clear();
+  recochain_entries.clear();
+  inputismc = false;
+  memset(&reader, 0, sizeof reader);
 }
 
+/* Make the output branches of the main and summary trees, or, if
+'existing', find them in trees read back from the file, and point them
+at what they are filled from. */
+static void bind_output(const bool existing)
+{
+  TTree * const recotree = writer.recotree;
+  otc_output_event & outevent = writer.outevent;
+  const int bs = writer.basketsize? writer.basketsize: 32000;
+
+  if(existing){
+    recotree->SetBranchAddress("length", &outevent.length);
+    recotree->SetBranchAddress("lastx", &outevent.lastx);
+    recotree->SetBranchAddress("lasty", &outevent.lasty);
+    recotree->SetBranchAddress("lastz", &outevent.lastz);
+    recotree->SetBranchAddress("error", &outevent.error);
+    recotree->SetBranchAddress("nhitup", &outevent.nhitup);
+    recotree->SetBranchAddress("nhitlo", &outevent.nhitlo);
+    if(writer.sparse) recotree->SetBranchAddress("event", &outevent.event);
+  }
+  else{
+    recotree->Branch("length", &outevent.length, bs);
+    recotree->Branch("lastx", &outevent.lastx, bs);
+    recotree->Branch("lasty", &outevent.lasty, bs);
+    recotree->Branch("lastz", &outevent.lastz, bs);
+    recotree->Branch("error", &outevent.error, bs);
+    recotree->Branch("nhitup", &outevent.nhitup, bs);
+    recotree->Branch("nhitlo", &outevent.nhitlo, bs);
+    if(writer.sparse)
+      recotree->Branch("event", &outevent.event, "event/l", bs);
+  }
+
+  if(!writer.sparse) return;
+
+  TTree * const summarytree = writer.summarytree;
+  otc_range_summary & s = writer.summary;
+  if(existing){
+    summarytree->SetBranchAddress("first", &s.first);
+    summarytree->SetBranchAddress("end", &s.end);
+    summarytree->SetBranchAddress("sumnhitup", &s.sumnhitup);
+    summarytree->SetBranchAddress("sumnhitlo", &s.sumnhitlo);
+    summarytree->SetBranchAddress("nevent", &s.nevent);
+    summarytree->SetBranchAddress("maxnhitup", &s.maxnhitup);
+    summarytree->SetBranchAddress("maxnhitlo", &s.maxnhitlo);
+  }
+  else{
+    summarytree->Branch("first", &s.first, "first/l");
+    summarytree->Branch("end", &s.end, "end/l");
+    summarytree->Branch("sumnhitup", &s.sumnhitup, "sumnhitup/l");
+    summarytree->Branch("sumnhitlo", &s.sumnhitlo, "sumnhitlo/l");
+    summarytree->Branch("nevent", &s.nevent, "nevent/i");
+    summarytree->Branch("maxnhitup", &s.maxnhitup, "maxnhitup/i");
+    summarytree->Branch("maxnhitlo", &s.maxnhitlo, "maxnhitlo/i");
+  }
+}
+
+/* Make the output file and its trees. Like all trees made after it, the
+trees belong to the file, which deletes them on closing. */
 static void root_init_output(const bool clobber,
                              const char * const outfilename)
 {
-  outfile = new TFile(outfilename, clobber?"RECREATE":"CREATE","",9);
+  TFile * const outfile = writer.outfile =
+    new TFile(outfilename, clobber?"RECREATE":"CREATE", "",
+              writer.compression);
 
   if(!outfile || outfile->IsZombie()){
     fprintf(stderr, "Could not open output file %s. Does it already exist?  "
@@ -256,41 +911,319 @@ static void root_init_output(const bool clobber,
   }
 
   // Name and title same as in old EnDep code
-  recotree = new TTree("otc", "OV time correction tree tree tree");
+  writer.recotree = new TTree("otc", "OV time correction tree tree tree");
+  if(writer.sparse)
+    writer.summarytree =
+      new TTree("otcsummary", "OTC summary of events not in otc");
+  bind_output(false);
+
+  if(writer.background) start_fill_thread();
+}
+
+/* Reopen output that was checkpointed holding nrow events and nsummary
+summaries, to carry on writing it. Returns false, with the file closed,
+if it doesn't hold that many as of its last checkpoint. */
+static bool root_resume_output(const char * const outfilename,
+                               const uint64_t nrow, const uint64_t nsummary)
+{
+  TFile * const outfile = writer.outfile = new TFile(outfilename, "UPDATE");
+  if(!outfile || outfile->IsZombie()){
+    fprintf(stderr, "Could not reopen output file %s\n", outfilename);
+    exit(1);
+  }
+  outfile->SetCompressionSettings(writer.compression);
+
+  writer.recotree = dynamic_cast<TTree *>(outfile->Get("otc"));
+  writer.summarytree = dynamic_cast<TTree *>(outfile->Get("otcsummary"));
+
+  const bool wassparse = writer.recotree &&
+                         writer.recotree->GetBranch("event") != NULL;
+  if(!writer.recotree || wassparse != writer.sparse ||
+     (writer.sparse && !writer.summarytree)){
+    fprintf(stderr, "%s is not %s otc output file\n", outfilename,
+            writer.sparse? "a sparse": "a non-sparse");
+    exit(1);
+  }
 
-  recotree->Branch("length", &outevent.length);
-  recotree->Branch("lastx", &outevent.lastx);
-  recotree->Branch("lasty", &outevent.lasty);
-  recotree->Branch("lastz", &outevent.lastz);
-  recotree->Branch("error", &outevent.error);
-  recotree->Branch("nhitup", &outevent.nhitup);
-  recotree->Branch("nhitlo", &outevent.nhitlo);
+  if(uint64_t(writer.recotree->GetEntries()) != nrow ||
+     (writer.sparse &&
+      uint64_t(writer.summarytree->GetEntries()) != nsummary)){
+    outfile->Close();
+    delete outfile;
+    writer.outfile = NULL;
+    writer.recotree = writer.summarytree = NULL;
+    return false;
+  }
+
+  bind_output(true);
+  if(writer.background) start_fill_thread();
+  return true;
 }
 
-void root_finish()
+/* In sparse mode, record the summary of a range of events that were
+not written out. */
+static void root_write_summary(const otc_range_summary & s)
 {
+  writer.summaries.push_back(s);
+}
+
+/* Fill the summaries held so far into their tree. The background
+thread, if any, must be idle. */
+static void fill_summaries()
+{
+  for(unsigned int i = 0; i < writer.summaries.size(); i++){
+    writer.summary = writer.summaries[i];
+    writer.summarytree->Fill();
+  }
+  writer.summaries.clear();
+}
+
+/* Write everything so far to the file, along with the trees' headers
+and the file's own, so that the file can be reopened as it is now even
+if it is never closed. */
+static void root_checkpoint()
+{
+  if(writer.background) drain_fill_thread();
+
+  writer.outfile->cd();
+  writer.recotree->AutoSave("SaveSelf");
+  if(writer.sparse){
+    fill_summaries();
+    writer.summarytree->AutoSave("SaveSelf");
+  }
+  writer.outfile->Flush();
+}
+
+static void root_finish()
+{
+  if(writer.background) stop_fill_thread();
+
   gErrorIgnoreLevel = kError;
-  outfile->cd();
-  recotree->Write();
-  outfile->Close();
+  writer.outfile->cd();
+
+  // Overwrite, so that a checkpoint doesn't leave an old copy behind
+  writer.recotree->Write("", TObject::kOverwrite);
+  if(writer.sparse){
+    fill_summaries();
+    writer.summarytree->Write("", TObject::kOverwrite);
+  }
+  writer.outfile->Close();
+  delete writer.outfile;
+  writer.outfile = NULL;
+  writer.recotree = writer.summarytree = NULL;
+}
+
+// ROOT's compression algorithms, by the numbers that go in the hundreds
+// place of a compression setting, with a reasonable level for each.
+static const struct {
+  const char * name;
+  int algorithm;
+  int defaultlevel;
+} compressors[] = {
+  { "zlib", 1, 1 },
+  { "lzma", 2, 8 },
+  { "lz4",  4, 4 },
+  { "zstd", 5, 5 },
+};
+
+/* Set the output compression from a string of the form "algorithm" or
+"algorithm:level", or "none". Exits if it doesn't make sense. Must be
+called before otc_root_sink() to have any effect. */
+void set_output_compression(const char * const spec)
+{
+  if(!strcmp(spec, "none")){
+    writer.compression = 0;
+    return;
+  }
+
+  const char * const colon = strchr(spec, ':');
+  const size_t namelen = colon? size_t(colon - spec): strlen(spec);
+
+  for(unsigned int i = 0; i < sizeof compressors/sizeof *compressors; i++){
+    if(strlen(compressors[i].name) != namelen ||
+       strncmp(compressors[i].name, spec, namelen)) continue;
+
+    int level = compressors[i].defaultlevel;
+    if(colon){
+      char * endptr;
+      level = strtol(colon+1, &endptr, 10);
+      if(endptr == colon+1 || *endptr != '\0' || level < 1 || level > 9){
+        fprintf(stderr, "Compression level in %s must be 1-9\n", spec);
+        exit(1);
+      }
+    }
+    writer.compression = 100*compressors[i].algorithm + level;
+    return;
+  }
+
+  fprintf(stderr, "Unknown compression %s. Use zlib, lzma, lz4, zstd or "
+          "none, optionally followed by :level, e.g. lz4:4\n", spec);
+  exit(1);
 }
 
-/* Sets up the ROOT input and output. */
-uint64_t root_init(const uint64_t maxevent, const bool clobber,
-                   const char * const outfilenm,
-                   const char * const * const infiles, const int nfiles)
+/* Set the buffer size of each output branch, in bytes, or zero for
+ROOT's default. Must be called before otc_root_sink(). */
+void set_output_basket_size(const int bytes)
+{
+  writer.basketsize = bytes;
+}
+
+/* If true, fill the output tree, and compress its baskets, on a
+background thread so that writing an event doesn't have to wait for
+it. Must be called before otc_root_sink(). */
+void set_output_background(const bool background)
+{
+  writer.background = background;
+}
+
+/* If true, write out only the events given to the sink, with their
+event numbers, and the range summaries. Must be called before
+otc_root_sink(). */
+void set_output_sparse(const bool sparse)
+{
+  writer.sparse = sparse;
+}
+
+namespace {
+  class root_source : public otc_event_source {
+    public:
+    root_source(const char * const * const infiles, const int nfiles):
+      bytesbefore(TFile::GetFileBytesRead())
+    {
+      ok = root_init_input(infiles, nfiles, n);
+    }
+
+    ~root_source()
+    {
+      root_close_input();
+    }
+
+    uint64_t nevent() const
+    {
+      return n;
+    }
+
+    unsigned int get_batch(otc_event_batch & b, const uint64_t first,
+                           const unsigned int nwanted, otc_arena & arena)
+    {
+      return root_get_batch(b, first, nwanted, arena);
+    }
+
+    // What was read from the files, before decompression. ROOT counts
+    // for the whole process, which may have read other files before
+    // these ones with --watch or --manifest.
+    uint64_t bytes_read() const
+    {
+      return TFile::GetFileBytesRead() - bytesbefore;
+    }
+
+    private:
+    uint64_t n, bytesbefore;
+
+    public:
+    // Whether all of the files could be read
+    bool ok;
+  };
+
+  class root_sink : public otc_event_sink {
+    public:
+    root_sink(const bool clobber, const char * const outfilename):
+      clobber(clobber), outfilename(outfilename)
+    {
+      // The file is only made in begin(), since a resumed run reopens
+      // it instead, but don't make the user wait until then to find out
+      // it's in the way.
+      if(!clobber && access(outfilename, F_OK) == 0){
+        fprintf(stderr, "Output file %s already exists.  Use -c to "
+                "overwrite existing output.\n", outfilename);
+        exit(1);
+      }
+    }
+
+    void begin(__attribute__((unused)) const uint64_t first,
+               __attribute__((unused)) const uint64_t end,
+               __attribute__((unused)) const uint64_t nsummary)
+    {
+      root_init_output(clobber, outfilename);
+    }
+
+    void write_event(const otc_output_event & out)
+    {
+      root_write_event(out);
+    }
+
+    void write_summary(const otc_range_summary & s)
+    {
+      root_write_summary(s);
+    }
+
+    void finish()
+    {
+      root_finish();
+    }
+
+    void checkpoint()
+    {
+      root_checkpoint();
+    }
+
+    bool resume(__attribute__((unused)) const uint64_t first,
+                __attribute__((unused)) const uint64_t end,
+                __attribute__((unused)) const uint64_t nsummarymax,
+                const uint64_t nrow, const uint64_t nsummary)
+    {
+      return root_resume_output(outfilename, nrow, nsummary);
+    }
+
+    private:
+    bool clobber;
+    const char * outfilename;
+  };
+};
+
+static void quiet_root()
 {
   // ROOT warnings are usually not helpful to the user, so we'll try
   // to catch warning conditions ourselves.  However, I know of at
   // least one error that can't be caught before a seg fault (!), so
   // let ROOT spew about that.
-  gErrorIgnoreLevel = kError; 
+  gErrorIgnoreLevel = kError;
+}
+
+/* Open the given muon.root files for reading, with only the input
+columns given as OTC_COL_ bits. Columns not read are null in the
+batches. If nunzip is nonzero, input is decompressed ahead of time on
+that many threads. There can only be one of these at a time. Returns
+null, having said why, if any of the files can't be read. */
+otc_event_source * otc_root_source(const char * const * const infiles,
+                                   const int nfiles, const int nunzip,
+                                   const unsigned int columns)
+{
+  quiet_root();
+  incolumns = columns;
 
-  root_init_output(clobber, outfilenm);
+  // Before ROOT 6.10, the parallel unzipping cache had its own thread.
+  // Since then, it gets its threads from the implicit multithreading
+  // pool, so that has to be turned on.
+  unzipthreads = nunzip;
+  #if ROOT_VERSION_CODE >= ROOT_VERSION(6,10,0) && defined(R__USE_IMT)
+    if(unzipthreads && !ROOT::IsImplicitMTEnabled())
+      ROOT::EnableImplicitMT(unzipthreads);
+  #endif
 
-  const uint64_t nevents = root_init_input(infiles, nfiles);
-  uint64_t neventstouse = nevents;
-  if(maxevent && nevents > maxevent) neventstouse = maxevent;
+  root_source * const source = new root_source(infiles, nfiles);
+  if(!source->ok){
+    delete source;
+    return NULL;
+  }
+  return source;
+}
 
-  return neventstouse;
+/* Write the ROOT output file. Unless 'clobber', exits if it exists.
+There can only be one of these at a time. */
+otc_event_sink * otc_root_sink(const bool clobber,
+                               const char * const outfilename)
+{
+  quiet_root();
+  return new root_sink(clobber, outfilename);
 }
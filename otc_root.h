@@ -1,7 +1,13 @@
-otc_input_event get_event(const uint64_t current_event);
-uint64_t root_init(const uint64_t maxevent, const bool clobber,
-                   const char * const outfile,
-                   const char * const * const infiles,
-                   const int nfiles);
-void write_event(const otc_output_event & out);
-void root_finish();
+#include "otc_io.h"
+
+void set_output_compression(const char * const spec);
+void set_output_basket_size(const int bytes);
+void set_output_background(const bool background);
+void set_output_sparse(const bool sparse);
+const char * otc_root_bad_name(const char * const fname);
+uint64_t otc_root_header_hash(const char * const fname);
+otc_event_source * otc_root_source(const char * const * const infiles,
+                                   const int nfiles, const int nunzip,
+                                   const unsigned int columns);
+otc_event_sink * otc_root_sink(const bool clobber,
+                               const char * const outfilename);
@@ -0,0 +1,230 @@
+/**
+  \author Matthew Strait
+  \brief Synthetic events and geometry, for running otc without data.
+*/
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "otc_synth.h"
+#include "otc_geom.h"
+
+// Modules 1-135 are in the lower OV and the rest in the upper, as with
+// the real thing. Each has 64 strips, and channel numbers go up by
+// module and then strip from zero.
+static const unsigned int NMODULE = 300, NSTRIP = 64;
+static const unsigned int LASTLOWER = 135;
+
+// Trigger boxes start at this channel number, with 100 numbers each, of
+// which the first 32 are used. Box b reads out the edges of module b+1.
+static const unsigned int FIRST_TB_CHANNEL = 20000, TBSPACING = 100;
+
+// Proportions of kinds of events and hits
+static const double SYNCFRACTION = 0.01;   // events that are sync pulses
+static const double SHOWERFRACTION = 0.02; // events with very many hits
+static const double EDGEFRACTION = 0.15;   // hits that are edge triggers
+static const double XYFRACTION = 0.35;     // muons with XY overlaps
+
+// The clock rolls over after this many ticks
+static const int CLOCKTICKS = 1 << 29;
+
+static uint64_t next(otc_synth & g)
+{
+  // xorshift64*
+  g.state ^= g.state >> 12;
+  g.state ^= g.state << 25;
+  g.state ^= g.state >> 27;
+  return g.state * 0x2545F4914F6CDD1DULL;
+}
+
+/* A random number from 0 up to, but not including, n */
+static unsigned int below(otc_synth & g, const unsigned int n)
+{
+  return (next(g) >> 32) % n;
+}
+
+/* A random number from 0 up to, but not including, 1 */
+static double uniform(otc_synth & g)
+{
+  return (next(g) >> 11) * (1.0/9007199254740992.0);
+}
+
+void otc_synth_seed(otc_synth & g, const uint64_t seed)
+{
+  // Zero is the one state that xorshift can't get out of
+  g.state = seed*0x9E3779B97F4A7C15ULL + 1;
+  if(!g.state) g.state = 1;
+}
+
+void otc_synth_geometry()
+{
+  for(int k = 0; k < OTC_NGEOMKIND; k++)
+    for(unsigned int ch = 0; ch < OTC_MAXCHNUM; ch++)
+      otc_geom_set(ch, otc_geomkind(k), 0, 0, 0, 0);
+
+  // Modules sit on a 15 by 10 grid of 1.6m squares in each of the lower
+  // and upper OV, alternating between strips along x and along y.
+  for(unsigned int mod = 1; mod <= NMODULE; mod++){
+    const bool upper = mod > LASTLOWER;
+    const unsigned int m = upper? mod - LASTLOWER - 1: mod - 1;
+    const double cx = (int(m%15) - 7)*1600.0, cy = (int(m/15%10) - 5)*1600.0;
+    const double z = upper? 10000 + 50*(m%2): 7000 + 50*(m%2);
+    const bool alongx = m%2;
+
+    for(unsigned int s = 0; s < NSTRIP; s++){
+      const double off = (s - NSTRIP/2.0 + 0.5)*25;
+      otc_geom_set((mod-1)*NSTRIP + s, OTC_NORMAL, mod,
+                   alongx? cx: cx + off, alongx? cy + off: cy, z);
+    }
+
+    // An edge trigger is between two strips, either of which it could
+    // have been from
+    const unsigned int tb = FIRST_TB_CHANNEL + (mod-1)*TBSPACING;
+    if(tb + 31 >= OTC_MAXCHNUM) continue;
+    for(unsigned int e = 0; e < 31; e++){
+      const double lo = (2*e - NSTRIP/2.0 + 0.5)*25, hi = lo + 25;
+      otc_geom_set(tb + e, OTC_EDGELOW, mod,
+                   alongx? cx: cx + lo, alongx? cy + lo: cy, z);
+      otc_geom_set(tb + e, OTC_EDGEHIGH, mod,
+                   alongx? cx: cx + hi, alongx? cy + hi: cy, z);
+    }
+  }
+}
+
+// What an event will have, decided before any of it is made so that the
+// columns can be allocated. Each event has its own generator, seeded
+// from one number from the main one, so that the events come out the
+// same however they are split into batches.
+struct evplan {
+  unsigned int nhit, nxy;
+  bool sync;
+  otc_synth gen;
+};
+
+/* Decide how big the next event is */
+static evplan plan_event(otc_synth & from)
+{
+  evplan p;
+  otc_synth_seed(p.gen, next(from));
+  otc_synth & g = p.gen;
+
+  p.sync = uniform(g) < SYNCFRACTION;
+  if(p.sync){
+    p.nhit = 32*(1 + below(g, 4));
+    p.nxy = 0;
+    return p;
+  }
+
+  // Showers are spread evenly out to a few thousand hits. Otherwise the
+  // number of hits falls off exponentially, averaging around 20.
+  if(uniform(g) < SHOWERFRACTION) p.nhit = 200 + below(g, 2800);
+  else p.nhit = 1 + unsigned(-20*log1p(-uniform(g)));
+
+  p.nxy = uniform(g) < XYFRACTION? 1 + below(g, 4): 0;
+  return p;
+}
+
+/* Fill in the hits of a sync pulse. The number of trigger boxes is
+nhit/32, and they all fire every channel at once. */
+static void make_sync(otc_synth & g, const unsigned int nhit,
+                      unsigned int * const ChNum,
+                      unsigned short * const Status,
+                      int * const Q, int * const Time)
+{
+  const int t = below(g, CLOCKTICKS);
+  const unsigned int box0 = below(g, 100);
+  for(unsigned int i = 0; i < nhit; i++){
+    ChNum[i] = FIRST_TB_CHANNEL + (box0 + i/32)*TBSPACING + i%32;
+    Status[i] = 4;
+    Q[i] = 0;
+    Time[i] = t;
+  }
+}
+
+/* Fill in the hits of a muon. They are in a few modules near each
+other, over a few clock cycles, in time order. */
+static void make_muon(otc_synth & g, const unsigned int nhit,
+                      unsigned int * const ChNum,
+                      unsigned short * const Status,
+                      int * const Q, int * const Time)
+{
+  const unsigned int mod0 = below(g, NMODULE);
+  const unsigned int length = 1 + below(g, 8);
+  const int t0 = below(g, CLOCKTICKS - length);
+
+  for(unsigned int i = 0; i < nhit; i++){
+    const unsigned int mod = (mod0 + below(g, 4)) % NMODULE + 1;
+    const unsigned int tb = FIRST_TB_CHANNEL + (mod-1)*TBSPACING;
+    if(uniform(g) < EDGEFRACTION && tb + 31 < OTC_MAXCHNUM){
+      ChNum[i] = tb + below(g, 31);
+      Status[i] = 4;
+    }
+    else{
+      ChNum[i] = (mod-1)*NSTRIP + below(g, NSTRIP);
+      Status[i] = 2;
+    }
+    Q[i] = below(g, 4000);
+    Time[i] = t0 + below(g, length);
+  }
+
+  std::sort(Time, Time + nhit);
+
+  // The last clock cycle always has something in it
+  Time[nhit-1] = t0 + length - 1;
+}
+
+void otc_synth_batch(otc_synth & g, otc_event_batch & b,
+                     const uint64_t first, const unsigned int n,
+                     otc_arena & arena)
+{
+  std::vector<evplan> plans(n);
+  unsigned int * const hitoffset = otc_arena_alloc<unsigned int>(arena, n+1);
+  unsigned int * const xyoffset = otc_arena_alloc<unsigned int>(arena, n+1);
+  hitoffset[0] = xyoffset[0] = 0;
+  for(unsigned int i = 0; i < n; i++){
+    plans[i] = plan_event(g);
+    hitoffset[i+1] = hitoffset[i] + plans[i].nhit;
+    xyoffset[i+1] = xyoffset[i] + plans[i].nxy;
+  }
+
+  const unsigned int nhit = hitoffset[n], nxy = xyoffset[n];
+  unsigned int * const ChNum = otc_arena_alloc<unsigned int>(arena, nhit);
+  unsigned short * const Status = otc_arena_alloc<unsigned short>(arena, nhit);
+  int * const Q = otc_arena_alloc<int>(arena, nhit);
+  int * const Time = otc_arena_alloc<int>(arena, nhit);
+  int * const xy_nhit = otc_arena_alloc<int>(arena, nxy);
+  int (* const xy_hits)[OTC_MAXXYHIT] =
+    reinterpret_cast<int (*)[OTC_MAXXYHIT]>(
+      otc_arena_alloc<int>(arena, nxy*OTC_MAXXYHIT));
+  bool * const readok = otc_arena_alloc<bool>(arena, n);
+
+  for(unsigned int i = 0; i < n; i++){
+    const unsigned int h = hitoffset[i];
+    otc_synth & eg = plans[i].gen;
+    if(plans[i].sync)
+      make_sync(eg, plans[i].nhit, ChNum+h, Status+h, Q+h, Time+h);
+    else
+      make_muon(eg, plans[i].nhit, ChNum+h, Status+h, Q+h, Time+h);
+
+    // Each overlap is made of a few of the event's hits
+    for(unsigned int x = xyoffset[i]; x < xyoffset[i+1]; x++){
+      xy_nhit[x] = 2 + below(eg, 3);
+      for(int j = 0; j < OTC_MAXXYHIT; j++)
+        xy_hits[x][j] = j < xy_nhit[x]? int(below(eg, plans[i].nhit)): 0;
+    }
+
+    readok[i] = true;
+  }
+
+  b.first = first;
+  b.n = n;
+  b.hitoffset = hitoffset;
+  b.ChNum = ChNum;
+  b.Status = Status;
+  b.Q = Q;
+  b.Time = Time;
+  b.xyoffset = xyoffset;
+  b.xy_nhit = xy_nhit;
+  b.xy_hits = xy_hits;
+  b.readok = readok;
+}
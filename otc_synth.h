@@ -0,0 +1,37 @@
+/**
+  \author Matthew Strait
+  \brief Synthetic events and geometry, for running otc without data.
+
+  The events are made to look roughly like real ones as far as the
+  speed of otc goes: mostly a few tens of hits, now and then a shower
+  of thousands, sync pulses, edge triggers and XY overlaps, in about
+  the proportions seen in data. The geometry is a stand-in with the
+  same channel numbering as the real one, but made up positions, so
+  that none of this needs ZOE.
+*/
+
+#ifndef OTC_SYNTH_H
+#define OTC_SYNTH_H
+
+#include <stdint.h>
+#include "otc_cont.h"
+#include "otc_arena.h"
+
+/// Fill the geometry table with the stand-in geometry
+void otc_synth_geometry();
+
+/// State of the event generator. The same seed always gives the same
+/// events, however many are made at a time.
+struct otc_synth {
+  uint64_t state;
+};
+
+void otc_synth_seed(otc_synth & g, const uint64_t seed);
+
+/// Make n events, numbered from 'first', into b, with memory from
+/// arena. All the columns are filled in and every event is readable.
+void otc_synth_batch(otc_synth & g, otc_event_batch & b,
+                     const uint64_t first, const unsigned int n,
+                     otc_arena & arena);
+
+#endif
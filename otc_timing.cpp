@@ -0,0 +1,289 @@
+/**
+  \author Matthew Strait
+  \brief Optional timing of each stage of processing.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vector>
+#include <algorithm>
+#include "otc_timing.h"
+
+using namespace std;
+
+bool otc_timing_on = false;
+
+// The histograms of time per event have this many bins per power of
+// two, so each bin is at most an eighth of its value wide. Times under
+// HIST_SUB ns get a bin each.
+static const unsigned int HIST_SUBBITS = 3, HIST_SUB = 1 << HIST_SUBBITS;
+static const unsigned int HIST_NBIN = (64 - HIST_SUBBITS + 1)*HIST_SUB;
+
+// How many of the slowest events to remember for each stage
+static const unsigned int NSLOWEST = 10;
+
+// The hardware counters, in the order they are read
+enum { CNT_CYCLES, CNT_CACHEMISS, CNT_BRANCHMISS, NCOUNTER };
+
+static const struct {
+  uint64_t config;
+  const char * name;
+} counterdefs[NCOUNTER] = {
+  { PERF_COUNT_HW_CPU_CYCLES,    "cycles"        },
+  { PERF_COUNT_HW_CACHE_MISSES,  "cache misses"  },
+  { PERF_COUNT_HW_BRANCH_MISSES, "branch misses" },
+};
+
+static const char * const stagenames[OTC_NSTAGE] = {
+  "read hits", "read reco", "compute", "fill"
+};
+
+struct slowevent {
+  uint64_t ns, event;
+};
+
+struct stagestats {
+  uint64_t ns;     // total time
+  uint64_t nevent; // number of events sampled
+  uint64_t maxns;  // slowest event
+  uint64_t hist[HIST_NBIN];
+
+  // Unsorted, with unused ones having ns == 0
+  slowevent slowest[NSLOWEST];
+
+  uint64_t counters[NCOUNTER];
+};
+
+// Everything one thread has recorded
+struct otc_timer {
+  stagestats stage[OTC_NSTAGE];
+
+  // The counter group, or -1 if there isn't one, and what the counters
+  // were at the last otc_timing_counters_begin()
+  int perffd;
+  uint64_t countstart[NCOUNTER];
+};
+
+namespace {
+  bool usecounters = false;
+
+  // Every thread's timer, for adding them up at the end
+  pthread_mutex_t timersmutex = PTHREAD_MUTEX_INITIALIZER;
+  vector<otc_timer *> timers;
+
+  // This thread's timer, made the first time it records anything
+  __thread otc_timer * mytimer = NULL;
+};
+
+/* Open a group of hardware counters for this thread, counting from
+now. Returns -1 if the kernel won't let us. */
+static int open_counters()
+{
+  int leader = -1;
+  for(int i = 0; i < NCOUNTER; i++){
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = counterdefs[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if(fd < 0){
+      if(leader != -1) close(leader);
+      return -1;
+    }
+    if(leader == -1) leader = fd;
+  }
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return leader;
+}
+
+static otc_timer * get_timer()
+{
+  if(mytimer) return mytimer;
+
+  otc_timer * const t = new otc_timer;
+  memset(t, 0, sizeof *t);
+  t->perffd = usecounters? open_counters(): -1;
+
+  pthread_mutex_lock(&timersmutex);
+  if(usecounters && t->perffd < 0 && timers.empty())
+    fprintf(stderr, "Could not open hardware counters. Maybe "
+            "/proc/sys/kernel/perf_event_paranoid is too high?\n");
+  timers.push_back(t);
+  pthread_mutex_unlock(&timersmutex);
+
+  return mytimer = t;
+}
+
+/* Read the counters of t's group into c. Returns false if there are
+none or they can't be read. */
+static bool read_counters(const otc_timer * const t, uint64_t * const c)
+{
+  if(t->perffd < 0) return false;
+
+  // With PERF_FORMAT_GROUP, the number of counters, then each value
+  uint64_t buf[1 + NCOUNTER];
+  if(read(t->perffd, buf, sizeof buf) != sizeof buf || buf[0] != NCOUNTER)
+    return false;
+  memcpy(c, buf + 1, sizeof buf - sizeof *buf);
+  return true;
+}
+
+void otc_timing_init(const bool counters)
+{
+  otc_timing_on = true;
+  usecounters = counters;
+}
+
+uint64_t otc_timing_now_slow()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+static unsigned int hist_bin(const uint64_t ns)
+{
+  if(ns < HIST_SUB) return ns;
+  const unsigned int e = 63 - __builtin_clzll(ns);
+  return (e - HIST_SUBBITS + 1)*HIST_SUB +
+         ((ns >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+/* The middle of the range of times in bin b */
+static double hist_value(const unsigned int b)
+{
+  if(b < HIST_SUB) return b;
+  const unsigned int e = b/HIST_SUB + HIST_SUBBITS - 1;
+  const double width = 1ULL << (e - HIST_SUBBITS);
+  return (HIST_SUB + b%HIST_SUB)*width + width/2;
+}
+
+void otc_timing_sample_slow(const otc_stage stage, const uint64_t first,
+                            const unsigned int n, const uint64_t ns)
+{
+  stagestats & s = get_timer()->stage[stage];
+  s.ns += ns;
+  if(!n) return;
+
+  // Events done together are each counted as taking their share
+  const uint64_t each = ns/n;
+  s.nevent += n;
+  s.hist[hist_bin(each)] += n;
+  if(each > s.maxns) s.maxns = each;
+
+  unsigned int fastest = 0;
+  for(unsigned int i = 1; i < NSLOWEST; i++)
+    if(s.slowest[i].ns < s.slowest[fastest].ns) fastest = i;
+  if(each > s.slowest[fastest].ns){
+    s.slowest[fastest].ns = each;
+    s.slowest[fastest].event = first;
+  }
+}
+
+void otc_timing_counters_begin_slow()
+{
+  otc_timer * const t = get_timer();
+  if(!read_counters(t, t->countstart)) t->perffd = -1;
+}
+
+void otc_timing_counters_end_slow(const otc_stage stage)
+{
+  otc_timer * const t = get_timer();
+  uint64_t c[NCOUNTER];
+  if(!read_counters(t, c)) return;
+  for(int i = 0; i < NCOUNTER; i++)
+    t->stage[stage].counters[i] += c[i] - t->countstart[i];
+}
+
+static bool slower(const slowevent & a, const slowevent & b)
+{
+  return a.ns > b.ns;
+}
+
+/* The time that fraction q of the events in s took at most */
+static double percentile(const stagestats & s, const double q)
+{
+  const uint64_t want = uint64_t(q*s.nevent);
+  uint64_t sofar = 0;
+  for(unsigned int b = 0; b < HIST_NBIN; b++)
+    if((sofar += s.hist[b]) > want) return hist_value(b);
+  return s.maxns;
+}
+
+void otc_timing_report()
+{
+  if(!otc_timing_on) return;
+
+  pthread_mutex_lock(&timersmutex);
+
+  stagestats all[OTC_NSTAGE];
+  memset(all, 0, sizeof all);
+  vector<slowevent> slowest[OTC_NSTAGE];
+  bool anycounters = false;
+
+  for(unsigned int t = 0; t < timers.size(); t++){
+    if(timers[t]->perffd >= 0){
+      anycounters = true;
+      close(timers[t]->perffd);
+      timers[t]->perffd = -1;
+    }
+    for(int i = 0; i < OTC_NSTAGE; i++){
+      const stagestats & s = timers[t]->stage[i];
+      all[i].ns += s.ns;
+      all[i].nevent += s.nevent;
+      all[i].maxns = max(all[i].maxns, s.maxns);
+      for(unsigned int b = 0; b < HIST_NBIN; b++) all[i].hist[b] += s.hist[b];
+      for(unsigned int j = 0; j < NSLOWEST; j++)
+        if(s.slowest[j].ns) slowest[i].push_back(s.slowest[j]);
+      for(int j = 0; j < NCOUNTER; j++) all[i].counters[j] += s.counters[j];
+    }
+  }
+
+  pthread_mutex_unlock(&timersmutex);
+
+  printf("Time by stage, summed over threads. Events read together are\n"
+         "each counted as taking their share of the time, and are named\n"
+         "by the first of them in the slowest events.\n");
+  printf("%-10s %10s %10s %10s %10s %10s\n", "Stage", "Total (s)", "Events",
+         "p50 (us)", "p99 (us)", "Max (us)");
+  for(int i = 0; i < OTC_NSTAGE; i++)
+    printf("%-10s %10.3f %10lu %10.3f %10.3f %10.3f\n", stagenames[i],
+           all[i].ns*1e-9, (unsigned long)all[i].nevent,
+           percentile(all[i], 0.50)*1e-3, percentile(all[i], 0.99)*1e-3,
+           all[i].maxns*1e-3);
+
+  if(anycounters){
+    printf("\n%-10s", "Stage");
+    for(int j = 0; j < NCOUNTER; j++) printf(" %15s", counterdefs[j].name);
+    printf("\n");
+    for(int i = 0; i < OTC_NSTAGE; i++){
+      printf("%-10s", stagenames[i]);
+      for(int j = 0; j < NCOUNTER; j++)
+        printf(" %15lu", (unsigned long)all[i].counters[j]);
+      printf("\n");
+    }
+  }
+
+  for(int i = 0; i < OTC_NSTAGE; i++){
+    if(slowest[i].empty()) continue;
+    sort(slowest[i].begin(), slowest[i].end(), slower);
+    if(slowest[i].size() > NSLOWEST) slowest[i].resize(NSLOWEST);
+    printf("\nSlowest events to %s:", stagenames[i]);
+    for(unsigned int j = 0; j < slowest[i].size(); j++)
+      printf("%s %lu (%.1f us)", j? ",": "",
+             (unsigned long)slowest[i][j].event, slowest[i][j].ns*1e-3);
+    printf("\n");
+  }
+}
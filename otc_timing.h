@@ -0,0 +1,97 @@
+/**
+  \author Matthew Strait
+  \brief Optional timing of each stage of processing.
+
+  When turned on, the time taken by reading hits, reading XY overlaps,
+  computing and filling the output is added up, along with a histogram
+  of the time per event and the slowest events of each stage, and
+  optionally the hardware counters for each stage. When off, which is
+  the default, each place that is timed costs one test of a flag.
+
+  Each thread keeps its own numbers, so timing from the worker threads
+  needs no locking. They are added together by otc_timing_report().
+*/
+
+#ifndef OTC_TIMING_H
+#define OTC_TIMING_H
+
+#include <stdint.h>
+
+/// The stages of processing that are timed. Sources that read hits and
+/// XY overlaps together count all of it as reading hits.
+enum otc_stage {
+  OTC_STAGE_READHITS,
+  OTC_STAGE_READRECO,
+  OTC_STAGE_COMPUTE,
+  OTC_STAGE_FILL,
+  OTC_NSTAGE
+};
+
+/// Whether timing is on. Don't set this directly.
+extern bool otc_timing_on;
+
+/// Turn timing on. If 'counters', also count CPU cycles, cache misses
+/// and branch mispredictions, if the kernel lets us. Must be called
+/// before any other thread is started.
+void otc_timing_init(const bool counters);
+
+uint64_t otc_timing_now_slow();
+void otc_timing_sample_slow(const otc_stage stage, const uint64_t first,
+                            const unsigned int n, const uint64_t ns);
+void otc_timing_counters_begin_slow();
+void otc_timing_counters_end_slow(const otc_stage stage);
+
+/// The current time in nanoseconds, or zero if timing is off
+static inline uint64_t otc_timing_now()
+{
+  return otc_timing_on? otc_timing_now_slow(): 0;
+}
+
+/// Record that events first through first+n-1 took 'ns' nanoseconds
+/// together in this stage. If n is zero, the time is only added to the
+/// total.
+static inline void otc_timing_sample(const otc_stage stage,
+                                     const uint64_t first,
+                                     const unsigned int n,
+                                     const uint64_t ns)
+{
+  if(otc_timing_on) otc_timing_sample_slow(stage, first, n, ns);
+}
+
+/// Start counting hardware events on this thread. Reading the counters
+/// is a system call, so this is for around a batch of events, not one.
+static inline void otc_timing_counters_begin()
+{
+  if(otc_timing_on) otc_timing_counters_begin_slow();
+}
+
+/// Add the hardware events since otc_timing_counters_begin() to stage
+static inline void otc_timing_counters_end(const otc_stage stage)
+{
+  if(otc_timing_on) otc_timing_counters_end_slow(stage);
+}
+
+/// Start timing a batch of events in one go. Returns what to pass to
+/// otc_timing_end().
+static inline uint64_t otc_timing_begin()
+{
+  otc_timing_counters_begin();
+  return otc_timing_now();
+}
+
+/// Record the time and hardware events since otc_timing_begin() as
+/// taken by events first through first+n-1 together in this stage.
+static inline void otc_timing_end(const otc_stage stage,
+                                  const uint64_t first,
+                                  const unsigned int n, const uint64_t start)
+{
+  if(!otc_timing_on) return;
+  otc_timing_sample_slow(stage, first, n, otc_timing_now_slow() - start);
+  otc_timing_counters_end_slow(stage);
+}
+
+/// Print everything recorded by all threads. Any other threads that
+/// recorded anything must be finished.
+void otc_timing_report();
+
+#endif